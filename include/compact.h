@@ -0,0 +1,48 @@
+#ifndef _COMPACT_H_
+#define _COMPACT_H_
+
+#include <types.h>
+#include <list.h>
+
+/*
+ * Owners of movable pages (see set_page_movable()) register a hook that
+ * walks their pages, migrates the ones page_should_migrate() selects with
+ * migrate_page() and updates their references.
+ */
+struct movable_owner {
+	void (*compact)(struct movable_owner *owner);
+	struct list owners;
+};
+
+void register_movable_owner(struct movable_owner *owner);
+void unregister_movable_owner(struct movable_owner *owner);
+
+int page_should_migrate(void *p);
+/* Returns the new copy of `p`, `p` is released. NULL if it cannot move */
+void *migrate_page(void *p);
+
+struct compact_stats {
+	u64 passes;
+	u64 migrated;		/* Pages moved */
+	u64 failed;		/* Pages that could not be moved */
+	u64 recovered;		/* Free 2M blocks gained */
+	u64 skipped;		/* Passes not worth running */
+};
+
+/*
+ * Returns the number of 2M blocks recovered by this pass. After a pass
+ * that recovered nothing, passes are skipped until pages are released.
+ */
+u64 compact_memory(void);
+const struct compact_stats *compact_get_stats(void);
+
+extern int compact_pages_released;
+
+/* Called by the page allocator on every release */
+static inline void compact_note_release(void)
+{
+	if (!compact_pages_released)
+		compact_pages_released = 1;
+}
+
+#endif /* !_COMPACT_H_ */
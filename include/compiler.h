@@ -5,12 +5,21 @@
 #define __unused 	__attribute__((unused))
 #define __maybe_unused 	__unused
 #define __used		__attribute__((used))
+#define __aligned(x)	__attribute__((aligned(x)))
+
+#define CACHELINE_SIZE	64
 
 #define __align(va, sz) ((va) & ~(sz - 1))
 #define __align_n(va, sz) (__align(va, sz) + sz)
 
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
 #define array_size(array) (sizeof(array) / sizeof(*array))
 
+#define __stringify_1(x)	#x
+#define __stringify(x)		__stringify_1(x)
+
 #define NULL ((void *)0)
 
 #ifndef offsetof
@@ -6,6 +6,9 @@
 /* TODO potentially factorize these */
 
 #define EPT_PTRS_PER_TABLE	512
+#define EPT_PADDR_MASK		0x000ffffffffff000ULL
+#define EPT_WRITE		(1ULL << 1)
+#define EPT_DIRTY		(1ULL << 9)
 struct eptp {
 	union {
 		struct {
@@ -145,10 +148,27 @@ struct vmm;
 paddr_t ept_translate(struct vmm *vmm, gpa_t addr);
 /* Guest virt -> Guest phys */
 gpa_t gva_to_gpa(struct vmm *vmm, gva_t gva);
-/* Guest virt -> Host virt */
+/* Same, `perms` (may be NULL) gets PG_WRITABLE|PG_USER|PG_NO_EXECUTE */
+gpa_t gva_translate(struct vmm *vmm, gva_t gva, u64 *perms);
+/* Guest virt -> Host virt, 0 if not mapped */
 hva_t gva_to_hva(struct vmm *vmm, gva_t gva);
-/* Guest phys -> Host virt */
+/* Guest phys -> Host virt, 0 if not mapped (yet) */
 hva_t gpa_to_hva(struct vmm *vmm, gpa_t gpa);
+/* Same, `len` gets how many bytes are contiguous in the host from there */
+hva_t gpa_to_hva_len(struct vmm *vmm, gpa_t gpa, u64 *len);
+
+/* Back the guest RAM page at `gpa` if not yet, returns 1 if out of memory */
+int ept_populate(struct vmm *vmm, gpa_t gpa);
+
+/*
+ * Dirty page logging of a RAM memslot, one bit per 4K page. Fetching the
+ * log clears it and rearms the tracking.
+ */
+struct memslot;
+int ept_enable_dirty_log(struct vmm *vmm, struct memslot *slot);
+int ept_get_dirty_log(struct vmm *vmm, struct memslot *slot, u64 *bitmap);
+/* Write to a page write protected for logging, returns 1 if it is not */
+int ept_log_dirty_write(struct vmm *vmm, gpa_t gpa);
 
 
 #endif
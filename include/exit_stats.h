@@ -0,0 +1,62 @@
+#ifndef _EXIT_STATS_H_
+#define _EXIT_STATS_H_
+
+#include <types.h>
+
+/*
+ * VM exit counters per exit reason with TSC latency histograms of the
+ * handler and of the whole exit (VM exit to VM entry), bucketed on a log2
+ * scale. I/O exits are also counted per port, in a fixed size table
+ * (ports past the table size are only summed up), CR accesses per
+ * register and reflected guest exceptions per vector. CR and INVLPG exits
+ * after CR3 load and INVLPG exiting are dropped are counted separately,
+ * to check that they almost stop in steady state.
+ */
+#define NR_EXIT_STAT_REASONS	64
+#define NR_LATENCY_BUCKETS	32	/* Bucket n: [2^n, 2^(n+1)) cycles */
+#define NR_IO_PORT_STATS	64
+#define NR_CR_STATS		16
+#define NR_EXCEPTION_STATS	32
+
+struct latency_hist {
+	u64 buckets[NR_LATENCY_BUCKETS];
+	u64 cycles;		/* Sum, for the mean */
+};
+
+struct exit_reason_stats {
+	u64 count;
+	struct latency_hist handler;
+	struct latency_hist total;
+};
+
+struct io_port_stat {
+	u32 port;		/* 0 if unused, port + 1 otherwise */
+	u64 count;
+};
+
+struct vm_exit_stats {
+	struct exit_reason_stats reasons[NR_EXIT_STAT_REASONS];
+	struct io_port_stat ports[NR_IO_PORT_STATS];
+	u64 other_ports;
+	u64 cr_accesses[NR_CR_STATS];
+	u64 late_cr_accesses;	/* Without CR3 load exiting */
+	u64 late_invlpgs;	/* Without INVLPG exiting */
+	u64 exceptions[NR_EXCEPTION_STATS];
+};
+
+/* Exits handled by the vm_exit_stub fast path, not timed */
+extern u64 fast_exit_counts[NR_EXIT_STAT_REASONS];
+
+void exit_stats_account(u16 reason, u64 handler_cycles, u64 total_cycles);
+void exit_stats_account_io(u16 port);
+void exit_stats_account_cr(u8 cr);
+void exit_stats_account_exception(u8 vec);
+void exit_stats_account_invlpg(void);
+void exit_stats_cr3_load_exits_dropped(void);
+const struct vm_exit_stats *exit_stats_get(void);
+
+/* Report on the console */
+void dump_exit_stats(void);
+void reset_exit_stats(void);
+
+#endif /* !_EXIT_STATS_H_ */
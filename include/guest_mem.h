@@ -0,0 +1,55 @@
+#ifndef _GUEST_MEM_H_
+#define _GUEST_MEM_H_
+
+#include <page_types.h>
+
+struct vmm;
+
+/*
+ * Iterator over the host memory backing a guest range, in chunks that are
+ * contiguous in the host: one translation per backing page (2M or 4K) for
+ * a GPA range, one per guest page for a GVA range. Guest RAM that is not
+ * backed yet is backed on the way.
+ */
+struct guest_iter {
+	struct vmm	*vmm;
+	u64		addr;	/* Next guest address */
+	u64		left;	/* Bytes left */
+	int		virt;	/* addr is a GVA */
+};
+
+struct guest_chunk {
+	void	*hva;
+	gpa_t	gpa;
+	u64	len;
+};
+
+static inline void guest_iter_init_phys(struct guest_iter *it,
+					struct vmm *vmm, gpa_t gpa, u64 size)
+{
+	it->vmm = vmm;
+	it->addr = gpa;
+	it->left = size;
+	it->virt = 0;
+}
+
+static inline void guest_iter_init_virt(struct guest_iter *it,
+					struct vmm *vmm, gva_t gva, u64 size)
+{
+	guest_iter_init_phys(it, vmm, gva, size);
+	it->virt = 1;
+}
+
+/*
+ * Returns 0 and the next chunk. Returns 1 once done, or on an address that
+ * does not translate, in which case it->left is not 0.
+ */
+int guest_iter_next(struct guest_iter *it, struct guest_chunk *chunk);
+
+/* Return 1 if part of the range does not translate (partial copy) */
+int copy_to_guest_phys(struct vmm *vmm, gpa_t gpa, const void *src, u64 size);
+int copy_from_guest_phys(struct vmm *vmm, void *dst, gpa_t gpa, u64 size);
+int copy_to_guest(struct vmm *vmm, gva_t gva, const void *src, u64 size);
+int copy_from_guest(struct vmm *vmm, void *dst, gva_t gva, u64 size);
+
+#endif /* !_GUEST_MEM_H_ */
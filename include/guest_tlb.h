@@ -0,0 +1,81 @@
+#ifndef _GUEST_TLB_H_
+#define _GUEST_TLB_H_
+
+#include <page_types.h>
+
+/*
+ * Software TLB for the guest page walks done by the VMM. It is direct
+ * mapped and tagged with the guest CR3 (PCID included). An entry holds the
+ * 4K page translation and the permissions combined over the walk
+ * (PG_WRITABLE, PG_USER, PG_NO_EXECUTE). PG_PRESENT marks valid entries.
+ * It is only used while guest CR3 writes and INVLPG exit, see
+ * vmx_drop_cr3_load_exits().
+ */
+#define GUEST_TLB_ENTRIES	64
+
+struct guest_tlb_entry {
+	u64	cr3;
+	gva_t	gva;
+	gpa_t	gpa;
+	u64	perms;
+};
+
+struct guest_tlb {
+	struct guest_tlb_entry entries[GUEST_TLB_ENTRIES];
+	u64 hits;
+	u64 misses;
+	u64 flushes;
+	u8 dirty;		/* Entries inserted since the last flush */
+};
+
+static inline struct guest_tlb_entry *guest_tlb_entry(struct guest_tlb *tlb,
+						      gva_t gva)
+{
+	return &tlb->entries[(gva >> PAGE_SHIFT) % GUEST_TLB_ENTRIES];
+}
+
+/* Returns (gpa_t)-1 on a miss */
+static inline gpa_t guest_tlb_lookup(struct guest_tlb *tlb, u64 cr3,
+				     gva_t gva, u64 *perms)
+{
+	const struct guest_tlb_entry *e = guest_tlb_entry(tlb, gva);
+	if (!(e->perms & PG_PRESENT) || e->cr3 != cr3
+	    || e->gva != (gva & PAGE_MASK)) {
+		tlb->misses++;
+		return (gpa_t)-1;
+	}
+
+	tlb->hits++;
+	*perms = e->perms;
+	return e->gpa + (gva & ~PAGE_MASK);
+}
+
+static inline void guest_tlb_insert(struct guest_tlb *tlb, u64 cr3,
+				    gva_t gva, gpa_t gpa, u64 perms)
+{
+	struct guest_tlb_entry *e = guest_tlb_entry(tlb, gva);
+	e->cr3 = cr3;
+	e->gva = gva & PAGE_MASK;
+	e->gpa = gpa & PAGE_MASK;
+	e->perms = perms | PG_PRESENT;
+	tlb->dirty = 1;
+}
+
+static inline void guest_tlb_flush_page(struct guest_tlb *tlb, gva_t gva)
+{
+	struct guest_tlb_entry *e = guest_tlb_entry(tlb, gva);
+	if (e->gva == (gva & PAGE_MASK))
+		e->perms = 0;
+}
+
+static inline void guest_tlb_flush(struct guest_tlb *tlb)
+{
+	if (!tlb->dirty)
+		return;
+	for (u32 i = 0; i < GUEST_TLB_ENTRIES; ++i)
+		tlb->entries[i].perms = 0;
+	tlb->dirty = 0;
+	tlb->flushes++;
+}
+
+#endif /* !_GUEST_TLB_H_ */
@@ -0,0 +1,20 @@
+#ifndef _HYPERCALL_H_
+#define _HYPERCALL_H_
+
+#include <types.h>
+
+/*
+ * VMCALL interface: the hypercall number is in rax, the result is returned
+ * in rax. Only the guest kernel (CPL 0) may issue hypercalls.
+ */
+#define HC_DUMP_MEM_STATS	1	/* Allocator reports on the console */
+#define HC_DUMP_TLB_STATS	2	/* Software guest TLB counters */
+#define HC_DUMP_EXIT_STATS	3	/* VM exit counters and latencies */
+#define HC_RESET_EXIT_STATS	4
+#define HC_STRIDE_BENCH		5	/* Test guest result, rbx: cycles */
+
+#define HC_SUCCESS		0
+#define HC_ENOSYS		((u64)-1)
+#define HC_EPERM		((u64)-2)
+
+#endif /* !_HYPERCALL_H_ */
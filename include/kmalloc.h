@@ -1,9 +1,21 @@
 #ifndef _KMALLOC_H_
 #define _KMALLOC_H_
 
+#include <types.h>
+
 void *kmalloc(u64 size);
 void kfree(void *p);
 
 int init_kmalloc(void);
 
+/*
+ * Named caches of fixed size objects. Objects smaller than a page come from
+ * slabs and can also be released with kfree(), page sized objects are kept
+ * in a bounded free page stack and must go through kmem_cache_free().
+ */
+struct kmem_cache;
+struct kmem_cache *kmem_cache_create(const char *name, u64 size);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
 #endif /* !_KMALLOC_H_ */
@@ -0,0 +1,54 @@
+#ifndef _MEM_STATS_H_
+#define _MEM_STATS_H_
+
+#include <types.h>
+
+/*
+ * Allocation and free counts per call site (caller return address),
+ * in a fixed size table: sites past the table size are only summed up.
+ */
+#define NR_ALLOC_SITES	128
+
+struct alloc_site {
+	const void *site;
+	u64 allocs;
+	u64 frees;
+};
+
+struct alloc_sites {
+	struct alloc_site sites[NR_ALLOC_SITES];
+	u64 untracked;
+};
+
+void alloc_site_account(struct alloc_sites *sites, const void *site,
+			int free);
+void alloc_sites_dump(const struct alloc_sites *sites);
+
+/* Units in use and the highest value ever reached */
+struct usage_counter {
+	u64 used;
+	u64 peak;
+};
+
+static inline void usage_add(struct usage_counter *c, u64 n)
+{
+	const u64 used = __atomic_add_fetch(&c->used, n, __ATOMIC_RELAXED);
+	u64 peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+	while (used > peak
+	       && !__atomic_compare_exchange_n(&c->peak, &peak, used, 1,
+					       __ATOMIC_RELAXED,
+					       __ATOMIC_RELAXED))
+		continue;
+}
+
+static inline void usage_sub(struct usage_counter *c, u64 n)
+{
+	__atomic_sub_fetch(&c->used, n, __ATOMIC_RELAXED);
+}
+
+void dump_page_stats(void);
+void dump_kmalloc_stats(void);
+/* Page allocator, kmalloc and compaction reports on the console */
+void dump_mem_stats(void);
+
+#endif /* !_MEM_STATS_H_ */
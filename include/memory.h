@@ -4,10 +4,27 @@
 #include <types.h>
 #include <page_types.h>
 
+/* A power of two number of pages is naturally aligned on its size */
 void *alloc_pages(u64 n);
 void *alloc_huge_pages(u64 n);
 void release_pages(void *p, u64 n);
 
+/*
+ * Movable pages may be migrated by compact_memory(), their owner must
+ * register a compaction hook and clear the flag before releasing them.
+ */
+void set_page_movable(void *p, int movable);
+
+/*
+ * Zeroed pages, 4K and 2M single pages come from pools zeroed ahead of
+ * time. refill_zeroed_pages() zeroes at most `budget` bytes for the pools,
+ * to run while the guest is idle, fill_zeroed_pages() fills them entirely.
+ */
+void *alloc_zeroed_pages(u64 n);
+void *alloc_zeroed_huge_pages(u64 n);
+void refill_zeroed_pages(u64 budget);
+void fill_zeroed_pages(void);
+
 static inline void *alloc_page(void)
 {
 	return alloc_pages(1);
@@ -18,6 +35,16 @@ static inline void *alloc_huge_page(void)
 	return alloc_huge_pages(1);
 }
 
+static inline void *alloc_zeroed_page(void)
+{
+	return alloc_zeroed_pages(1);
+}
+
+static inline void *alloc_zeroed_huge_page(void)
+{
+	return alloc_zeroed_huge_pages(1);
+}
+
 static inline void release_page(void *p)
 {
 	release_pages(p, 1);
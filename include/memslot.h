@@ -0,0 +1,71 @@
+#ifndef _MEMSLOT_H_
+#define _MEMSLOT_H_
+
+#include <page_types.h>
+
+/*
+ * Guest physical layout: a sorted table of non overlapping slots. Gaps
+ * between slots are holes (MMIO).
+ * A slot without host backing is RAM backed on first access, a slot with
+ * one maps that physically contiguous host memory as is.
+ * RAM slots keep the HVA of every 2M block backed by a 2M page so that
+ * most GPA -> HVA lookups need no EPT walk.
+ */
+#define MEMSLOT_READONLY	(1 << 0)	/* ROM */
+#define MEMSLOT_RESERVED	(1 << 1)	/* Not reported as RAM */
+#define MEMSLOT_DIRTY_LOG	(1 << 2)	/* Writes are logged */
+
+#define NR_MEMSLOTS		8
+
+/* 32 bit MMIO hole, RAM past its start is moved above 4G */
+#define MMIO_HOLE_START		0xc0000000ULL
+#define MMIO_HOLE_END		0x100000000ULL
+
+struct memslot {
+	gpa_t	base;
+	u64	size;
+	hva_t	backing;
+	u32	flags;
+	hva_t	*huge_hva;	/* Per 2M block, 0 if not backed by a 2M page */
+	u64	*dirty_bitmap;	/* One bit per 4K page, with MEMSLOT_DIRTY_LOG */
+};
+
+struct memslots {
+	struct memslot slots[NR_MEMSLOTS];
+	u32 nr_slots;
+	u32 last;		/* Last slot found */
+};
+
+#define for_each_memslot(memslots, slot)				\
+	for (slot = (memslots)->slots;					\
+	     slot < (memslots)->slots + (memslots)->nr_slots; ++slot)
+
+static inline int memslot_contains(const struct memslot *slot, gpa_t gpa)
+{
+	return slot->base <= gpa && gpa - slot->base < slot->size;
+}
+
+/* Index of the 2M block of `gpa` in huge_hva */
+static inline u64 memslot_block(const struct memslot *slot, gpa_t gpa)
+{
+	return (gpa >> PMD_SHIFT) - (slot->base >> PMD_SHIFT);
+}
+
+static inline u64 memslot_dirty_bitmap_size(const struct memslot *slot)
+{
+	const u64 nb_pages = (slot->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	return (nb_pages + 63) / 64 * sizeof(u64);
+}
+
+/* Set the dirty bits of [gpa, gpa + len), the range must be in the slot */
+void memslot_mark_dirty(struct memslot *slot, gpa_t gpa, u64 len);
+
+/* Returns 1 if the table is full or the slot overlaps another one */
+int memslot_add(struct memslots *memslots, gpa_t base, u64 size,
+		hva_t backing, u32 flags);
+struct memslot *memslot_find(struct memslots *memslots, gpa_t gpa);
+void memslots_clear(struct memslots *memslots);
+/* Lay out `ram_size` bytes of RAM around the legacy and MMIO holes */
+int memslots_add_ram(struct memslots *memslots, u64 ram_size);
+
+#endif /* !_MEMSLOT_H_ */
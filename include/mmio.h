@@ -0,0 +1,58 @@
+#ifndef _MMIO_H_
+#define _MMIO_H_
+
+#include <page_types.h>
+
+/*
+ * Emulated MMIO regions. Their pages are mapped with a misconfigured EPT
+ * entry so that guest accesses exit with an EPT misconfiguration, whose
+ * handler decodes the instruction and calls the region callbacks with the
+ * offset in the region and the access size.
+ */
+#define NR_MMIO_REGIONS		16
+
+/* Without a callback, writes are dropped and reads return all ones */
+struct mmio_ops {
+	u64	(*read)(void *opaque, u64 offset, u8 size);
+	void	(*write)(void *opaque, u64 offset, u8 size, u64 val);
+};
+
+struct mmio_region {
+	gpa_t			base;
+	u64			size;
+	const struct mmio_ops	*ops;
+	void			*opaque;
+};
+
+struct mmio_regions {
+	struct mmio_region regions[NR_MMIO_REGIONS];
+	u32 nr_regions;
+};
+
+/* Returns 1 if the table is full or the region overlaps another one */
+int mmio_region_add(struct mmio_regions *mmio, gpa_t base, u64 size,
+		    const struct mmio_ops *ops, void *opaque);
+struct mmio_region *mmio_region_find(struct mmio_regions *mmio, gpa_t gpa);
+
+/* Longest x86 instruction */
+#define MMIO_INSN_MAX		15
+
+/* A MOV (or MOVZX) between a register or an immediate and memory */
+struct mmio_insn {
+	u8	len;
+	u8	size;		/* Access size in bytes */
+	u8	write;		/* Store to memory */
+	u8	reg;		/* GPR number, when not an immediate store */
+	u8	high_byte;	/* reg is AH, CH, DH or BH */
+	u8	reg_size;	/* Destination size of a load, in bytes */
+	u8	imm_op;
+	u64	imm;
+};
+
+/*
+ * Decode the `len` bytes at `insn`, `mode` is the default address size in
+ * bytes (2, 4 or 8 in 64 bit mode). Returns 1 if it is not emulated.
+ */
+int mmio_decode(const u8 *insn, u64 len, u8 mode, struct mmio_insn *mi);
+
+#endif /* !_MMIO_H_ */
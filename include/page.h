@@ -16,19 +16,97 @@ struct mem_zone {
 	u8  type;
 };
 
+/* Zones are stored right after the modules, sized from the boot memory map */
+struct memory_map {
+	struct mem_zone *zones;
+	u32 zone_cnt;
+};
+
+extern struct memory_map memory_map;
+
+/* Kernel start */
+extern char _start[];
+
+static inline int mem_is_usable(const u8 type)
+{
+	return type & MEM_RAM_USABLE;
+}
+
+paddr_t first_valid_paddr(void);
+paddr_t last_valid_paddr(void);
+u8 paddr_mem_type(paddr_t paddr);
+
+#define FRAME_FREE	(1 << 0)	/* Head of a free buddy block */
+#define FRAME_LARGE	(1 << 1)	/* Head of a kmalloc() large allocation */
+#define FRAME_MOVABLE	(1 << 2)	/* Can be migrated by compaction */
+
+/* Buddy allocator orders: 4K (0) up to 1G (18) blocks */
+#define MAX_ORDER	18
+#define HUGE_PAGE_ORDER	(PMD_SHIFT - PAGE_SHIFT)
+#define GIANT_PAGE_ORDER (PUD_SHIFT - PAGE_SHIFT)
+
+#ifdef FRAME_BITMAP
+/*
+ * The bitmap backend keeps no per-frame structure: a frame handle is the
+ * frame's own PHYS_MAP address and must never be dereferenced.
+ */
+struct page_frame;
+#else
 struct page_frame {
-	vaddr_t vaddr;
-	struct list free_list;
+	u32 order;	/* Order of the block this frame heads */
+	u32 flags;
+	union {
+		struct list free_list;	/* FRAME_FREE */
+		u64 nr_pages;		/* FRAME_LARGE */
+	};
 };
+#endif
 
 // TODO static inline these
 paddr_t page_to_phys(const struct page_frame *frame);
 struct page_frame *phys_to_page(const paddr_t addr);
 struct page_frame *pfn_to_page(u64 pfn);
 int memory_init(struct multiboot_tag_mmap *mmap, vaddr_t first_frame_addr);
+/* Frame allocator backend, its metadata is placed at `mod_end` */
+void setup_frame_state(vaddr_t mod_end);
+/*
+ * Initialize the frame metadata deferred by setup_frame_state(), until
+ * then only part of the memory can be allocated.
+ */
+void finish_frame_init(void);
 
 struct page_frame *alloc_page_frames(u64 n);
 void release_page_frames(struct page_frame *p, u64 n);
+/* Memory used by the frame allocator bookkeeping, in bytes */
+u64 frame_metadata_size(void);
+
+/* Size, in pages, of the large allocation starting at `f` (0 if none) */
+void frame_set_large(struct page_frame *f, u64 nr_pages);
+u64 frame_large_pages(const struct page_frame *f);
+
+/* Movable frames must have their flag cleared before being released */
+void frame_set_movable(struct page_frame *f, int movable);
+int frame_is_movable(const struct page_frame *f);
+
+/* Free frames of the 2M block holding `pfn` */
+u64 frame_huge_block_free(u64 pfn);
+/* Number of completely free 2M blocks */
+u64 frame_free_huge_blocks(void);
+/* One free frame of the 2M block holding `pfn`, NULL if there is none */
+struct page_frame *alloc_frame_in_block(u64 pfn);
+void *alloc_page_in_block(paddr_t paddr);
+
+/* Free memory as seen by the frame allocator, in frames */
+struct frame_stats {
+	u64 nr_free;
+	u64 largest_run;		/* Largest free contiguous run */
+	u64 nr_blocks[MAX_ORDER + 1];	/* Free blocks (runs) per order */
+};
+
+void frame_get_stats(struct frame_stats *stats);
+
+/* Give the frames cached in the per-CPU magazines back to the allocator */
+void drain_page_magazines(void);
 
 static inline paddr_t virt_to_phys(const vaddr_t vaddr)
 {
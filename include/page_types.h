@@ -27,7 +27,8 @@ typedef unsigned gfp_t;
 #define PG_DIRTY		(1 << 6)
 #define PG_HUGE_PAGE		(1 << 7)
 #define PG_GLOBAL		(1 << 8)
-#define PG_NO_EXECUTE		(1 << 63)
+#define PG_NO_EXECUTE		(1ULL << 63)
+#define PG_PADDR_MASK		0x000ffffffffff000ULL
 
 #define PAGE_SHIFT	12
 #define PAGE_SIZE	(1UL << PAGE_SHIFT)
@@ -63,9 +64,13 @@ typedef unsigned gfp_t;
  */
 #define PAGE_OFFSET 		0xffffffff80000000ULL
 
-/* 4G Physical memory map */
-#define PHYS_MAP_START		0xffffff8000000000ULL
-#define PHYS_MAP_END		(PHYS_MAP_START + (4ULL << 30))
+/*
+ * Direct map of the physical memory, with 1G pages. It is built from the
+ * memory map and covers at least the low 4G.
+ */
+#define PHYS_MAP_START		0xffff880000000000ULL
+#define PHYS_MAP_MAX_SIZE	(4ULL << 40)
+#define PHYS_MAP_END		(PHYS_MAP_START + PHYS_MAP_MAX_SIZE)
 
 #define HUGE_PAGE_SIZE		(2 << 20)
 #define pg_present(p)		((pte_t)p & PG_PRESENT)
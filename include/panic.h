@@ -1,9 +1,12 @@
 #ifndef _PANIC_H_
 #define _PANIC_H_
 
+#include <uart_8250.h>
+
 /* TODO real panic func */
 #define panic(fmt, ...) 		\
 ({					\
+	uart_8250_flush();		\
 	printf(fmt, ##__VA_ARGS__); 	\
 	for (;;)			\
 		asm volatile ("hlt");	\
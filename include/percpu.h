@@ -0,0 +1,29 @@
+#ifndef _PERCPU_H_
+#define _PERCPU_H_
+
+#include <compiler.h>
+#include <types.h>
+
+#define NR_CPUS	16
+
+/*
+ * Per-CPU area, pointed to by the GS base of its CPU. Every CPU calls
+ * percpu_init() with its index before using the allocators, the BSP being
+ * CPU 0.
+ */
+struct percpu {
+	u32 cpu_id;	/* Index in per-CPU arrays */
+} __aligned(CACHELINE_SIZE);
+
+void percpu_init(u32 cpu);
+
+static inline u32 cpu_id(void)
+{
+	u32 id;
+	asm volatile ("movl %%gs:%c1, %0"
+		      : "=r"(id)
+		      : "i"(offsetof(struct percpu, cpu_id)));
+	return id;
+}
+
+#endif /* !_PERCPU_H_ */
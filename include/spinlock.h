@@ -0,0 +1,30 @@
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include <types.h>
+
+typedef struct {
+	volatile u32 locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { .locked = 0 }
+
+static inline void spin_lock(spinlock_t *lock)
+{
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+		while (lock->locked)
+			asm volatile ("pause");
+}
+
+/* Returns 1 if the lock was taken */
+static inline int spin_trylock(spinlock_t *lock)
+{
+	return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif /* !_SPINLOCK_H_ */
@@ -0,0 +1,27 @@
+#ifndef _UART_8250_H_
+#define _UART_8250_H_
+
+#include <types.h>
+
+struct x86_regs;
+struct io_access_info;
+
+void emulate_uart_8250(struct x86_regs *regs, struct io_access_info *info);
+
+/*
+ * Guest COM1 transmit buffer, filled by the VM exit fast path while THR is
+ * addressed (DLAB clear) and printed on the slow path. A byte written
+ * UART_TX_MAX_CYCLES after the oldest buffered one takes the slow path,
+ * so does an idle guest (HLT).
+ */
+#define UART_TX_BUF_SIZE	256
+#define UART_TX_MAX_CYCLES	0x4000000
+
+extern char uart_tx_buf[UART_TX_BUF_SIZE];
+extern u32 uart_tx_len;
+extern u64 uart_tx_tsc;		/* When the oldest byte was buffered */
+extern u8 uart_tx_direct;
+
+void uart_8250_flush(void);
+
+#endif /* !_UART_8250_H_ */
@@ -4,17 +4,29 @@
 #include "x86.h"
 #include "ept.h"
 #include "vmx_guest.h"
+#include <compact.h>
+#include <guest_tlb.h>
+#include <memslot.h>
+#include <mmio.h>
 #include <stdio.h>
 
 #define NR_VMX_MSR 17
 
 /* VM Execution control fields */
+#define VM_PIN_NMI_EXIT				(1 << 3)
+#define VM_PIN_VIRTUAL_NMIS			(1 << 5)
+#define VM_EXEC_INTR_WINDOW_EXIT		(1 << 2)
+#define VM_EXEC_HLT_EXIT			(1 << 7)
+#define VM_EXEC_INVLPG_EXIT			(1 << 9)
 #define VM_EXEC_CR3_LOAD_EXIT			(1 << 15)
+#define VM_EXEC_NMI_WINDOW_EXIT			(1 << 22)
 #define VM_EXEC_USE_MSR_BITMAPS			(1 << 28)
 #define VM_EXEC_ENABLE_PROC_CTLS2		(1 << 31)
 #define VM_EXEC_ENABLE_EPT			(1 << 1)
+#define VM_EXEC_ENABLE_VPID			(1 << 5)
 #define VM_EXEC_UNRESTRICTED_GUEST		(1 << 7)
 #define VM_EXEC_UNCONDITIONAL_IO_EXIT		(1 << 24)
+#define VM_EXEC_ENABLE_PML			(1 << 17)
 
 /* VM Exit control fields */
 #define VM_EXIT_SAVE_DBG_CTLS			(1 << 2)
@@ -294,6 +306,35 @@ struct vmcs_guest_state {
 	u64	pdpte[4];
 };
 
+/*
+ * Guest fields used on the exit path, read from the VMCS on first access
+ * and written back before VM entry if modified. Only valid for one exit:
+ * vm_exit_dispatch() forgets what was read since the previous one.
+ */
+enum vmcs_cached_field {
+	VCACHE_RIP,
+	VCACHE_RSP,
+	VCACHE_RFLAGS,
+	VCACHE_CR0,
+	VCACHE_CR3,
+	VCACHE_CR4,
+	VCACHE_EFER,
+	VCACHE_CS_BASE,
+	VCACHE_CS_AR,
+	VCACHE_SS_AR,
+	VCACHE_PDPTE0,
+	VCACHE_PDPTE1,
+	VCACHE_PDPTE2,
+	VCACHE_PDPTE3,
+	NR_VCACHE_FIELDS,
+};
+
+struct vmcs_cache {
+	u64	val[NR_VCACHE_FIELDS];
+	u32	valid;
+	u32	dirty;
+};
+
 struct vaddr_range {
 	vaddr_t start;
 	vaddr_t end;
@@ -308,19 +349,59 @@ struct vmm {
 	struct vmcs *vmx_on;
 	struct vmcs *vmcs;
 
-	struct vaddr_range guest_mem;
+	struct memslots memslots;	/* Guest physical layout */
+	struct mmio_regions mmio;	/* Emulated devices */
+	struct guest_tlb tlb;		/* Guest virtual translations */
 	struct vaddr_range guest_img;
 	struct vaddr_range guest_initrd;
 
 	struct eptp eptp;
 	struct vmcs_host_state host_state;
-	struct vmcs_guest_state guest_state;
+	struct vmcs_guest_state guest_state;	/* Initial state */
+	struct vmcs_cache vmcs_cache;
 
 	u8 *msr_bitmap;
+	u64 *pml_log;			/* Page modification log, if enabled */
+	u16 vpid;			/* Guest TLB tag, 0 if not in use */
+	u8 cr3_load_exits;		/* Guest CR3 writes are seen */
+	u8 hlt_activity;		/* The HLT activity state is supported */
+	u64 pending_irqs[4];		/* Delayed external interrupts */
+	u8 pending_nmi;			/* Delayed NMI */
+	u8 virtual_nmis;		/* NMI-window exiting is available */
+
+	/* Compaction hook migrating the EPT tables */
+	struct movable_owner ept_owner;
 
 	int (*setup_guest)(struct vmm *);
 };
 
+struct vm_exit_code {
+	union {
+		struct {
+			u16	exit_reason;
+			u32	reserved1 : 11;
+			u32	enclave : 1;
+			u32	pending_mtf : 1;
+			u32	vmx_root : 1;
+			u32	reserved2 : 1;
+			u32	vm_entry : 1;
+		};
+		u32	dword;
+	};
+} __packed;
+
+/*
+ * Per-vCPU register save area, at the top of the VM exit stack: HOST_RSP
+ * points to it. Its layout is known to vm_exit_stub.
+ */
+struct vm_exit_ctx {
+	struct x86_regs 	regs;
+	u64			exit_qual;
+	struct vm_exit_code 	exit_code;
+	u32			pad;	/* VMREAD stores 64 bits */
+	struct vmm		*vmm;
+} __packed;
+
 struct io_access_info {
 	union {
 		struct {
@@ -342,6 +423,28 @@ int vmm_init(struct vmm *);
 void dump_guest_state(struct vmcs_guest_state *state);
 const char *get_vmcs_field_str(enum vmcs_field field);
 int init_vm_exit_handlers(struct vmm *vmm);
+/* Move the page modification log to the dirty bitmaps */
+void vmx_flush_pml(struct vmm *vmm);
+/* Register an emulated MMIO region, page aligned and outside of RAM */
+int vmx_add_mmio_region(struct vmm *vmm, gpa_t base, u64 size,
+			const struct mmio_ops *ops, void *opaque);
+/* Drop the guest TLB entries tagged with the vCPU VPID */
+void vmx_flush_guest_tlb(struct vmm *vmm);
+void vmx_flush_guest_page(struct vmm *vmm, gva_t gva);
+/*
+ * Make guest exceptions on `vec` exit (e.g. #DB and #BP for debugging),
+ * they are reflected to the guest after being counted. The VMCS must be
+ * the current one.
+ */
+void vmx_intercept_exception(u8 vec, int intercept);
+/* Guest CR0 and CR4 values for what the guest wrote, with the fixed bits */
+u64 vmx_guest_cr0(struct vmm *vmm, u64 cr0);
+u64 vmx_guest_cr4(struct vmm *vmm, u64 cr4);
+void vmx_drop_cr3_load_exits(struct vmm *vmm);
+/* Exit as soon as the guest can take an interrupt */
+void vmx_interrupt_window_exits(struct vmm *vmm, int enable);
+/* Same for an NMI, needs vmm->virtual_nmis */
+void vmx_nmi_window_exits(struct vmm *vmm, int enable);
 
 /*
  * Assembly magic to execute VMX instructions that
@@ -379,6 +482,49 @@ static inline int __vmptrld(paddr_t paddr)
 	return __vmx_insn_paddr(vmptrld, paddr);
 }
 
+#define INVEPT_SINGLE_CONTEXT	1
+#define INVEPT_ALL_CONTEXT	2
+
+static inline int __invept(u64 type, u64 eptp)
+{
+	struct {
+		u64 eptp;
+		u64 reserved;
+	} desc = { eptp, 0 };
+
+	asm volatile goto ("invept %0, %1\n\t"
+			   "jbe %l2"
+			   : /* No output */
+			   : "m"(desc), "r"(type)
+			   : "memory", "cc"
+			   : fail);
+	return 0;
+fail:
+	return 1;
+}
+
+#define INVVPID_INDIVIDUAL_ADDR		0
+#define INVVPID_SINGLE_CONTEXT		1
+#define INVVPID_ALL_CONTEXT		2
+
+static inline int __invvpid(u64 type, u16 vpid, u64 gva)
+{
+	struct {
+		u64 vpid;
+		u64 gva;
+	} desc = { vpid, gva };
+
+	asm volatile goto ("invvpid %0, %1\n\t"
+			   "jbe %l2"
+			   : /* No output */
+			   : "m"(desc), "r"(type)
+			   : "memory", "cc"
+			   : fail);
+	return 0;
+fail:
+	return 1;
+}
+
 static inline void __vmxoff(void)
 {
 	asm volatile ("vmxoff");
@@ -422,6 +568,30 @@ fail:
 	printf("VMWRITE failed: field=%#x\tval=%#lx\n", field, value);
 }
 
+extern const enum vmcs_field vmcs_cached_fields[NR_VCACHE_FIELDS];
+
+static inline u64 vmcs_cache_read(struct vmm *vmm, enum vmcs_cached_field f)
+{
+	struct vmcs_cache *cache = &vmm->vmcs_cache;
+	if (!(cache->valid & (1u << f))) {
+		__vmread(vmcs_cached_fields[f], &cache->val[f]);
+		cache->valid |= 1u << f;
+	}
+	return cache->val[f];
+}
+
+static inline void vmcs_cache_write(struct vmm *vmm, enum vmcs_cached_field f,
+				    u64 val)
+{
+	struct vmcs_cache *cache = &vmm->vmcs_cache;
+	cache->val[f] = val;
+	cache->valid |= 1u << f;
+	cache->dirty |= 1u << f;
+}
+
+/* Write back the modified fields and forget the others */
+void vmcs_cache_flush(struct vmm *vmm);
+
 static inline int __vmlaunch(void)
 {
 	asm volatile goto("vmlaunch\n\t"
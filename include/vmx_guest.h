@@ -4,6 +4,7 @@
 struct vmm;
 void setup_test_guest(struct vmm *vmm);
 int setup_test_guest32(struct vmm *vmm);
+int setup_stride_bench_guest(struct vmm *vmm);
 int setup_linux_guest(struct vmm *vmm);
 
 #endif
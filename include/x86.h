@@ -96,6 +96,7 @@
 
 /* TODO static inline write to reg wrapper */
 #define write_cr0(x)	__writeq(cr0, (x))
+#define write_cr2(x)	__writeq(cr2, (x))
 #define write_cr3(x) 	__writeq(cr3, (x))
 #define write_cr4(x) 	__writeq(cr4, (x))
 
@@ -149,6 +150,16 @@ static inline u16 __str(void)
 	return ret;
 }
 
+static inline u64 read_dr6(void)
+{
+	return __readq(dr6);
+}
+
+static inline void write_dr6(u64 val)
+{
+	__writeq(dr6, val);
+}
+
 static inline u64 read_dr7(void)
 {
 	return __readq(dr7);
@@ -163,6 +174,13 @@ static inline u64 read_rflags(void)
 	return ret;
 }
 
+static inline u64 rdtsc(void)
+{
+	u64 low, high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return EAX_EDX_VAL(low, high);
+}
+
 struct x86_regs {
 	u64	rip;
 	u64	rflags;
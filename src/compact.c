@@ -0,0 +1,125 @@
+#include <compact.h>
+#include <memory.h>
+#include <page.h>
+#include <spinlock.h>
+#include <string.h>
+
+/*
+ * Compaction evacuates the movable pages of sparse 2M blocks (at least
+ * half free) so that those blocks become entirely free. The pages are
+ * moved to the free frames of dense blocks, which are scanned from the
+ * top of memory down.
+ */
+#define COMPACT_MIN_FREE	(PTRS_PER_TABLE / 2)
+
+static DECLARE_LIST(movable_owners);
+static spinlock_t compact_lock = SPINLOCK_INIT;
+static struct compact_stats compact_stats;
+
+/* Next dense block to fill, scanned downwards, -1 once they are all full */
+static s64 target_block;
+
+/*
+ * Set when pages are released. A pass that recovered nothing clears it:
+ * until then, another one would find the same blocks.
+ */
+int compact_pages_released = 1;
+
+void register_movable_owner(struct movable_owner *owner)
+{
+	spin_lock(&compact_lock);
+	list_add(&movable_owners, &owner->owners);
+	spin_unlock(&compact_lock);
+}
+
+void unregister_movable_owner(struct movable_owner *owner)
+{
+	spin_lock(&compact_lock);
+	list_remove(&owner->owners);
+	spin_unlock(&compact_lock);
+}
+
+static inline u64 block_free(paddr_t paddr)
+{
+	return frame_huge_block_free(paddr >> PAGE_SHIFT);
+}
+
+int page_should_migrate(void *p)
+{
+	const paddr_t paddr = virt_to_phys((vaddr_t)p);
+	return frame_is_movable(phys_to_page(paddr))
+	       && block_free(paddr) >= COMPACT_MIN_FREE;
+}
+
+static inline paddr_t block_paddr(u64 block)
+{
+	return block << PMD_SHIFT;
+}
+
+static void *alloc_migration_target(void)
+{
+	for (; target_block >= 0; --target_block) {
+		const u64 nr_free = block_free(block_paddr(target_block));
+		if (nr_free == 0 || nr_free >= COMPACT_MIN_FREE)
+			continue;
+
+		void *p = alloc_page_in_block(block_paddr(target_block));
+		if (p != NULL)
+			return p;
+	}
+	return NULL;
+}
+
+void *migrate_page(void *p)
+{
+	void *new = alloc_migration_target();
+	if (new == NULL) {
+		compact_stats.failed++;
+		return NULL;
+	}
+
+	memcpy(new, p, PAGE_SIZE);
+	set_page_movable(new, 1);
+	set_page_movable(p, 0);
+	release_page(p);
+	compact_stats.migrated++;
+	return new;
+}
+
+u64 compact_memory(void)
+{
+	struct movable_owner *owner;
+
+	spin_lock(&compact_lock);
+
+	if (!compact_pages_released) {
+		compact_stats.skipped++;
+		spin_unlock(&compact_lock);
+		return 0;
+	}
+
+	/* Cached frames would be counted as used */
+	drain_page_magazines();
+	const u64 before = frame_free_huge_blocks();
+	target_block = (last_valid_paddr() - 1) >> PMD_SHIFT;
+
+	list_for_each_entry(&movable_owners, owner, owners)
+		owner->compact(owner);
+
+	drain_page_magazines();
+
+	const u64 after = frame_free_huge_blocks();
+	const u64 recovered = after > before ? after - before : 0;
+	compact_stats.passes++;
+	compact_stats.recovered += recovered;
+	/* Migrations released pages too */
+	compact_pages_released = recovered != 0;
+
+	spin_unlock(&compact_lock);
+	return recovered;
+}
+
+const struct compact_stats *compact_get_stats(void)
+{
+	return &compact_stats;
+}
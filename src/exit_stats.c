@@ -0,0 +1,136 @@
+#include <compiler.h>
+#include <exit_stats.h>
+#include <interrupts.h>
+#include <stdio.h>
+#include <string.h>
+
+static struct vm_exit_stats exit_stats;
+u64 fast_exit_counts[NR_EXIT_STAT_REASONS];
+static int cr3_load_exits_dropped;
+
+static inline void latency_hist_add(struct latency_hist *hist, u64 cycles)
+{
+	const u32 bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+	hist->buckets[min(bucket, NR_LATENCY_BUCKETS - 1)]++;
+	hist->cycles += cycles;
+}
+
+void exit_stats_account(u16 reason, u64 handler_cycles, u64 total_cycles)
+{
+	if (reason >= NR_EXIT_STAT_REASONS)
+		return;
+
+	struct exit_reason_stats *stats = &exit_stats.reasons[reason];
+	stats->count++;
+	latency_hist_add(&stats->handler, handler_cycles);
+	latency_hist_add(&stats->total, total_cycles);
+}
+
+static inline u32 port_hash(u16 port)
+{
+	return (port * 0x9e3779b1u) >> 26;	/* 6 bits */
+}
+
+void exit_stats_account_io(u16 port)
+{
+	const u32 hash = port_hash(port);
+	for (u32 i = 0; i < NR_IO_PORT_STATS; ++i) {
+		struct io_port_stat *s =
+			&exit_stats.ports[(hash + i) % NR_IO_PORT_STATS];
+		if (s->port == 0)
+			s->port = port + 1;
+		if (s->port != port + 1u)
+			continue;
+		s->count++;
+		return;
+	}
+	exit_stats.other_ports++;
+}
+
+void exit_stats_account_cr(u8 cr)
+{
+	if (cr < NR_CR_STATS)
+		exit_stats.cr_accesses[cr]++;
+	if (cr3_load_exits_dropped)
+		exit_stats.late_cr_accesses++;
+}
+
+void exit_stats_account_invlpg(void)
+{
+	if (cr3_load_exits_dropped)
+		exit_stats.late_invlpgs++;
+}
+
+void exit_stats_cr3_load_exits_dropped(void)
+{
+	cr3_load_exits_dropped = 1;
+}
+
+void exit_stats_account_exception(u8 vec)
+{
+	if (vec < NR_EXCEPTION_STATS)
+		exit_stats.exceptions[vec]++;
+}
+
+const struct vm_exit_stats *exit_stats_get(void)
+{
+	return &exit_stats;
+}
+
+static void dump_latency_hist(const char *name, const struct latency_hist *hist,
+			      u64 count)
+{
+	printf("    %s: mean %llu cycles\n", name, hist->cycles / count);
+	for (u32 i = 0; i < NR_LATENCY_BUCKETS; ++i) {
+		if (hist->buckets[i])
+			printf("      [2^%u, 2^%u): %llu\n", i, i + 1,
+			       hist->buckets[i]);
+	}
+}
+
+void dump_exit_stats(void)
+{
+	printf("VM exits:\n");
+	for (u32 i = 0; i < NR_EXIT_STAT_REASONS; ++i) {
+		const struct exit_reason_stats *stats = &exit_stats.reasons[i];
+		if (fast_exit_counts[i])
+			printf("  reason %u: %llu fast exits\n", i,
+			       fast_exit_counts[i]);
+		if (!stats->count)
+			continue;
+		printf("  reason %u: %llu exits\n", i, stats->count);
+		dump_latency_hist("handler", &stats->handler, stats->count);
+		dump_latency_hist("total", &stats->total, stats->count);
+	}
+
+	for (u32 i = 0; i < NR_IO_PORT_STATS; ++i) {
+		const struct io_port_stat *s = &exit_stats.ports[i];
+		if (s->port)
+			printf("  port %#x: %llu\n", s->port - 1, s->count);
+	}
+	if (exit_stats.other_ports)
+		printf("  other ports: %llu\n", exit_stats.other_ports);
+
+	for (u32 i = 0; i < NR_CR_STATS; ++i) {
+		if (exit_stats.cr_accesses[i])
+			printf("  CR%u: %llu\n", i, exit_stats.cr_accesses[i]);
+	}
+	if (cr3_load_exits_dropped) {
+		printf("  CR exits without CR3 load exiting: %llu\n",
+		       exit_stats.late_cr_accesses);
+		printf("  INVLPG exits without INVLPG exiting: %llu\n",
+		       exit_stats.late_invlpgs);
+	}
+
+	for (u32 i = 0; i < NR_EXCEPTION_STATS; ++i) {
+		if (exit_stats.exceptions[i])
+			printf("  %s: %llu\n", exception_str(i),
+			       exit_stats.exceptions[i]);
+	}
+}
+
+void reset_exit_stats(void)
+{
+	memset(&exit_stats, 0, sizeof(exit_stats));
+	memset(fast_exit_counts, 0, sizeof(fast_exit_counts));
+}
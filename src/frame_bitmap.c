@@ -0,0 +1,345 @@
+#include <compiler.h>
+#include <page.h>
+#include <string.h>
+
+#ifdef FRAME_BITMAP
+
+#define BITS_PER_WORD		64
+#define FRAMES_PER_CHUNK	PTRS_PER_TABLE	/* One 2M block */
+#define WORDS_PER_CHUNK		(FRAMES_PER_CHUNK / BITS_PER_WORD)
+
+#define INVALID_PFN		((u64)-1)
+
+/*
+ * Compact frame state: one bit per frame (set when free) plus a summary
+ * level holding the number of free frames of every 2M chunk, so that full
+ * chunks are skipped and free 2M blocks are found without scanning the
+ * bitmap. 256G of RAM costs 8M per bitmap and 256K of summary.
+ * Large allocations are recorded with two more bits per frame marking
+ * their first and last frames, and movable frames with a fourth one.
+ */
+struct frame_bitmap {
+	u64 *bitmap;
+	u64 *large_head;	/* First frame of a large allocation */
+	u64 *large_end;		/* Last frame of a large allocation */
+	u64 *movable;		/* Frames that can be migrated */
+	u16 *nr_free;		/* Free frames per 2M chunk */
+	u64 nb_frames;
+	u64 nb_chunks;
+	vaddr_t end;		/* End of the bitmap metadata */
+};
+
+static struct frame_bitmap frame_bitmap;
+
+paddr_t page_to_phys(const struct page_frame *frame)
+{
+	return virt_to_phys((vaddr_t)frame);
+}
+
+struct page_frame *phys_to_page(const paddr_t paddr)
+{
+	return (struct page_frame *)phys_to_virt(paddr);
+}
+
+struct page_frame *pfn_to_page(u64 pfn)
+{
+	return phys_to_page(pfn << PAGE_SHIFT);
+}
+
+static inline u64 page_to_pfn(const struct page_frame *frame)
+{
+	return page_to_phys(frame) >> PAGE_SHIFT;
+}
+
+static inline u64 pfn_chunk(u64 pfn)
+{
+	return pfn / FRAMES_PER_CHUNK;
+}
+
+static inline u64 chunk_pfn(u64 chunk)
+{
+	return chunk * FRAMES_PER_CHUNK;
+}
+
+/* Mask of bits [start, end) of a word */
+static inline u64 word_mask(u64 start, u64 end)
+{
+	u64 mask = ~0ULL << start;
+	if (end < BITS_PER_WORD)
+		mask &= ~(~0ULL << end);
+	return mask;
+}
+
+static inline int bit_test(const u64 *map, u64 bit)
+{
+	return (map[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+static inline void bit_assign(u64 *map, u64 bit, int val)
+{
+	const u64 mask = 1ULL << (bit % BITS_PER_WORD);
+	if (val)
+		map[bit / BITS_PER_WORD] |= mask;
+	else
+		map[bit / BITS_PER_WORD] &= ~mask;
+}
+
+/* Mark [pfn, pfn + n) free or used, one word at a time */
+static void frame_range_set(u64 pfn, u64 n, int free)
+{
+	const u64 end = pfn + n;
+	while (pfn < end) {
+		const u64 word_start = pfn & ~(BITS_PER_WORD - 1);
+		u64 next = word_start + BITS_PER_WORD;
+		if (next > end)
+			next = end;
+
+		/* Words never cross a chunk boundary */
+		u64 *word = &frame_bitmap.bitmap[pfn / BITS_PER_WORD];
+		u16 *nr_free = &frame_bitmap.nr_free[pfn_chunk(pfn)];
+		const u64 mask = word_mask(pfn - word_start, next - word_start);
+		if (free) {
+			*word |= mask;
+			*nr_free += next - pfn;
+		} else {
+			*word &= ~mask;
+			*nr_free -= next - pfn;
+		}
+		pfn = next;
+	}
+}
+
+/* Returns the first frame >= pfn that is free (or used if !free) */
+static u64 find_next_frame(u64 pfn, int free)
+{
+	const u64 limit = frame_bitmap.nb_frames;
+	const u16 skip = free ? 0 : FRAMES_PER_CHUNK;
+
+	while (pfn < limit) {
+		/* Skip whole chunks thanks to the summary */
+		if (frame_bitmap.nr_free[pfn_chunk(pfn)] == skip) {
+			pfn = chunk_pfn(pfn_chunk(pfn) + 1);
+			continue;
+		}
+
+		u64 word = frame_bitmap.bitmap[pfn / BITS_PER_WORD];
+		if (!free)
+			word = ~word;
+		word &= ~0ULL << (pfn % BITS_PER_WORD);
+		if (word) {
+			pfn = (pfn & ~(BITS_PER_WORD - 1)) + __builtin_ctzll(word);
+			return pfn < limit ? pfn : limit;
+		}
+		pfn = (pfn | (BITS_PER_WORD - 1)) + 1;
+	}
+	return limit;
+}
+
+/* First fit run of `n` free frames, power of two runs are aligned on n */
+static u64 find_free_run(u64 n)
+{
+	const u64 align = (n & (n - 1)) ? 1 : n;
+	u64 pfn = 0;
+	while ((pfn = find_next_frame(pfn, 1)) < frame_bitmap.nb_frames) {
+		const u64 end = find_next_frame(pfn, 0);
+		pfn = __align_n(pfn - 1, align);
+		if (pfn < end && end - pfn >= n)
+			return pfn;
+		pfn = end;
+	}
+	return INVALID_PFN;
+}
+
+/*
+ * First fit run of `n` completely free 2M chunks, only uses the summary.
+ * Power of two runs are aligned on n chunks.
+ */
+static u64 find_free_chunks(u64 n)
+{
+	const u64 align = (n & (n - 1)) ? 1 : n;
+	for (u64 start = 0; start + n <= frame_bitmap.nb_chunks; start += align) {
+		u64 chunk = start;
+		while (chunk < start + n
+		       && frame_bitmap.nr_free[chunk] == FRAMES_PER_CHUNK)
+			++chunk;
+		if (chunk == start + n)
+			return chunk_pfn(start);
+
+		/* The next candidate starts past the used chunk */
+		start = __align(chunk, align);
+	}
+	return INVALID_PFN;
+}
+
+struct page_frame *alloc_page_frames(u64 nb_frames)
+{
+	if (nb_frames == 0)
+		return NULL;
+
+	/* Runs of 2M or more are whole chunks, aligned like buddy blocks */
+	u64 pfn;
+	if (nb_frames >= FRAMES_PER_CHUNK) {
+		u64 nb_chunks = nb_frames / FRAMES_PER_CHUNK;
+		if (nb_frames % FRAMES_PER_CHUNK)
+			++nb_chunks;
+		pfn = find_free_chunks(nb_chunks);
+	} else {
+		pfn = find_free_run(nb_frames);
+	}
+
+	if (pfn == INVALID_PFN)
+		return NULL;
+
+	frame_range_set(pfn, nb_frames, 0);
+	return pfn_to_page(pfn);
+}
+
+void release_page_frames(struct page_frame *f, u64 n)
+{
+	frame_range_set(page_to_pfn(f), n, 1);
+}
+
+u64 frame_metadata_size(void)
+{
+	return frame_bitmap.end - (vaddr_t)frame_bitmap.bitmap;
+}
+
+void frame_set_large(struct page_frame *f, u64 nr_pages)
+{
+	const u64 pfn = page_to_pfn(f);
+	if (nr_pages) {
+		bit_assign(frame_bitmap.large_head, pfn, 1);
+		bit_assign(frame_bitmap.large_end, pfn + nr_pages - 1, 1);
+		return;
+	}
+
+	const u64 last = pfn + frame_large_pages(f) - 1;
+	bit_assign(frame_bitmap.large_head, pfn, 0);
+	bit_assign(frame_bitmap.large_end, last, 0);
+}
+
+u64 frame_large_pages(const struct page_frame *f)
+{
+	const u64 pfn = page_to_pfn(f);
+	if (!bit_test(frame_bitmap.large_head, pfn))
+		return 0;
+
+	/* Large allocations do not nest, the next end bit is ours */
+	u64 bit = pfn;
+	u64 word = frame_bitmap.large_end[bit / BITS_PER_WORD]
+		   & (~0ULL << (bit % BITS_PER_WORD));
+	while (word == 0) {
+		bit = (bit | (BITS_PER_WORD - 1)) + 1;
+		word = frame_bitmap.large_end[bit / BITS_PER_WORD];
+	}
+	bit = (bit & ~(BITS_PER_WORD - 1)) + __builtin_ctzll(word);
+	return bit - pfn + 1;
+}
+
+void frame_set_movable(struct page_frame *f, int movable)
+{
+	bit_assign(frame_bitmap.movable, page_to_pfn(f), movable);
+}
+
+int frame_is_movable(const struct page_frame *f)
+{
+	return bit_test(frame_bitmap.movable, page_to_pfn(f));
+}
+
+u64 frame_huge_block_free(u64 pfn)
+{
+	return frame_bitmap.nr_free[pfn_chunk(pfn)];
+}
+
+u64 frame_free_huge_blocks(void)
+{
+	u64 res = 0;
+	for (u64 chunk = 0; chunk < frame_bitmap.nb_chunks; ++chunk)
+		res += frame_bitmap.nr_free[chunk] == FRAMES_PER_CHUNK;
+	return res;
+}
+
+struct page_frame *alloc_frame_in_block(u64 pfn)
+{
+	const u64 chunk = pfn_chunk(pfn);
+	if (frame_bitmap.nr_free[chunk] == 0)
+		return NULL;
+
+	pfn = find_next_frame(chunk_pfn(chunk), 1);
+	frame_range_set(pfn, 1, 0);
+	return pfn_to_page(pfn);
+}
+
+/* Free runs are counted in nr_blocks by the order of their length */
+void frame_get_stats(struct frame_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	u64 pfn = 0;
+	while ((pfn = find_next_frame(pfn, 1)) < frame_bitmap.nb_frames) {
+		const u64 end = find_next_frame(pfn, 0);
+		const u64 run = end - pfn;
+		const u32 order = 63 - __builtin_clzll(run);
+
+		stats->nr_blocks[min(order, MAX_ORDER)]++;
+		stats->nr_free += run;
+		stats->largest_run = max(stats->largest_run, run);
+		pfn = end;
+	}
+}
+
+static void free_zone_range(paddr_t start, paddr_t end)
+{
+	start = __align_n(start - 1, PAGE_SIZE);
+	end = __align(end, PAGE_SIZE);
+	if (start < end)
+		frame_range_set(start >> PAGE_SHIFT, (end - start) >> PAGE_SHIFT, 1);
+}
+
+void setup_frame_state(vaddr_t mod_end)
+{
+	struct frame_bitmap *state = &frame_bitmap;
+	const paddr_t last_paddr = __align(last_valid_paddr(), PAGE_SIZE);
+
+	state->nb_frames = last_paddr >> PAGE_SHIFT;
+	state->nb_chunks = pfn_chunk(state->nb_frames + FRAMES_PER_CHUNK - 1);
+
+	/* Use PHYS_MAP mapping for the bitmap, right after the modules */
+	vaddr_t start = phys_to_virt(virt_to_phys(__align_n(mod_end - 1, 8)));
+	const u64 nb_words = state->nb_chunks * WORDS_PER_CHUNK;
+	state->bitmap = (u64 *)start;
+	state->large_head = state->bitmap + nb_words;
+	state->large_end = state->large_head + nb_words;
+	state->movable = state->large_end + nb_words;
+	state->nr_free = (u16 *)(state->movable + nb_words);
+	state->end = __align_n((vaddr_t)(state->nr_free + state->nb_chunks) - 1,
+			       PAGE_SIZE);
+
+	/* Everything is used until proven usable */
+	memset(state->bitmap, 0, state->end - start);
+
+	const paddr_t reserved_start = virt_to_phys(_start);
+	const paddr_t reserved_end = virt_to_phys(state->end);
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i) {
+		const struct mem_zone *zone = &memory_map.zones[i];
+		if (!mem_is_usable(zone->type))
+			continue;
+
+		const paddr_t zone_end = zone->start + zone->length;
+		if (zone_end <= reserved_start || zone->start >= reserved_end) {
+			free_zone_range(zone->start, zone_end);
+			continue;
+		}
+		if (zone->start < reserved_start)
+			free_zone_range(zone->start, reserved_start);
+		if (zone_end > reserved_end)
+			free_zone_range(reserved_end, zone_end);
+	}
+}
+
+/* The bitmap is entirely set up at boot */
+void finish_frame_init(void)
+{
+}
+
+#endif /* FRAME_BITMAP */
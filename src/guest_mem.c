@@ -0,0 +1,96 @@
+#include <compiler.h>
+#include <guest_mem.h>
+#include <string.h>
+#include <vmx.h>
+
+int guest_iter_next(struct guest_iter *it, struct guest_chunk *chunk)
+{
+	if (it->left == 0)
+		return 1;
+
+	gpa_t gpa = it->addr;
+	if (it->virt) {
+		gpa = gva_to_gpa(it->vmm, it->addr);
+		if (gpa == (gpa_t)-1)
+			return 1;
+	}
+
+	u64 len;
+	hva_t hva = gpa_to_hva_len(it->vmm, gpa, &len);
+	if (hva == 0) {
+		if (ept_populate(it->vmm, gpa))
+			return 1;
+		hva = gpa_to_hva_len(it->vmm, gpa, &len);
+	}
+
+	/* The next guest page may be anywhere */
+	if (it->virt)
+		len = min(len, PAGE_SIZE - (it->addr & ~PAGE_MASK));
+	len = min(len, it->left);
+
+	chunk->hva = (void *)hva;
+	chunk->gpa = gpa;
+	chunk->len = len;
+	it->addr += len;
+	it->left -= len;
+	return 0;
+}
+
+/* Host writes show in the dirty log too */
+static void mark_chunk_dirty(struct vmm *vmm, const struct guest_chunk *chunk)
+{
+	struct memslot *slot = memslot_find(&vmm->memslots, chunk->gpa);
+	if (slot->flags & MEMSLOT_DIRTY_LOG)
+		memslot_mark_dirty(slot, chunk->gpa, chunk->len);
+}
+
+static int copy_to_iter(struct guest_iter *it, const void *src)
+{
+	struct guest_chunk chunk;
+	const u8 *p = src;
+	while (!guest_iter_next(it, &chunk)) {
+		mark_chunk_dirty(it->vmm, &chunk);
+		memcpy(chunk.hva, p, chunk.len);
+		p += chunk.len;
+	}
+	return it->left != 0;
+}
+
+static int copy_from_iter(struct guest_iter *it, void *dst)
+{
+	struct guest_chunk chunk;
+	u8 *p = dst;
+	while (!guest_iter_next(it, &chunk)) {
+		memcpy(p, chunk.hva, chunk.len);
+		p += chunk.len;
+	}
+	return it->left != 0;
+}
+
+int copy_to_guest_phys(struct vmm *vmm, gpa_t gpa, const void *src, u64 size)
+{
+	struct guest_iter it;
+	guest_iter_init_phys(&it, vmm, gpa, size);
+	return copy_to_iter(&it, src);
+}
+
+int copy_from_guest_phys(struct vmm *vmm, void *dst, gpa_t gpa, u64 size)
+{
+	struct guest_iter it;
+	guest_iter_init_phys(&it, vmm, gpa, size);
+	return copy_from_iter(&it, dst);
+}
+
+int copy_to_guest(struct vmm *vmm, gva_t gva, const void *src, u64 size)
+{
+	struct guest_iter it;
+	guest_iter_init_virt(&it, vmm, gva, size);
+	return copy_to_iter(&it, src);
+}
+
+int copy_from_guest(struct vmm *vmm, void *dst, gva_t gva, u64 size)
+{
+	struct guest_iter it;
+	guest_iter_init_virt(&it, vmm, gva, size);
+	return copy_from_iter(&it, dst);
+}
@@ -1,115 +1,381 @@
+#include <kmalloc.h>
+#include <mem_stats.h>
 #include <page.h>
 #include <memory.h>
+#include <percpu.h>
+#include <spinlock.h>
+#include <stdio.h>
+#include <string.h>
 
-#define ARENA_SIZE HUGE_PAGE_SIZE
+/*
+ * Slab layer: every cache carves SLAB_SIZE naturally aligned slabs in
+ * objects of the same size. The slab header sits at the start of the slab
+ * so an object's slab is found by aligning its address down.
+ */
+#define SLAB_PAGES	4
+#define SLAB_SIZE	(SLAB_PAGES * PAGE_SIZE)
+#define SLAB_HDR_SIZE	64	/* Keep the first object cache aligned */
 
-#define CHUNK_SIZE(sz) (sz + sizeof(struct mem_chunk))
+/* kmalloc size classes: 16, 24, 32, 48, ..., 1536, 2048 */
+#define KMALLOC_MIN_SHIFT	4
+#define KMALLOC_MAX_SHIFT	11
+#define KMALLOC_MIN_SIZE	(1UL << KMALLOC_MIN_SHIFT)
+#define KMALLOC_MAX_SIZE	(1UL << KMALLOC_MAX_SHIFT)
+#define NR_KMALLOC_CLASSES	(2 * (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT) + 1)
 
-struct mem_arena {
-	void *max_brk;
-	void *cur_brk;
-	struct list next_arena;
-	struct list free_chunks;
-	char data[0];
+/* Page caches keep at most that many free pages around */
+#define KMEM_CACHE_MAX_FREE_PAGES	64
+
+/*
+ * Per-CPU magazines of free objects in front of every cache, the cache
+ * lock is only taken to refill or drain half a magazine.
+ */
+#define MAGAZINE_SIZE	16
+#define MAGAZINE_BATCH	(MAGAZINE_SIZE / 2)
+
+struct magazine {
+	u32 count;
+	void *objs[MAGAZINE_SIZE];
+	u64 allocs;	/* Objects handed out by this CPU */
+	u64 frees;
+} __aligned(CACHELINE_SIZE);
+
+struct slab {
+	struct kmem_cache *cache;
+	void *free_objs;	/* Singly linked through the free objects */
+	u32 nr_free;
+	struct list next_slab;
 };
 
-struct mem_chunk {
-	u64 size;
-	struct list free_chunks;
+struct kmem_cache {
+	const char *name;
+	u64 obj_size;
+	u32 objs_per_slab;
+	struct list partial_slabs;	/* Slabs with free objects */
+	struct list next_cache;
+
+	/* Page sized objects are kept in a free page stack, without slab */
+	void *free_pages;
+	u64 nr_free_pages;
+
+	u64 nr_slabs;
+
+	spinlock_t lock;	/* Protects slabs and free pages */
+	struct magazine magazines[NR_CPUS];
 };
 
-static DECLARE_LIST(arena_list);
+static struct kmem_cache kmalloc_caches[NR_KMALLOC_CLASSES];
+static struct kmem_cache cache_cache;	/* struct kmem_cache objects */
+static DECLARE_LIST(cache_list);
 
-static void init_arena(struct mem_arena *arena, u64 size)
+/* Bytes handed out by kmalloc() and the caches */
+static struct usage_counter kmalloc_usage;
+static struct alloc_sites kmalloc_sites;
+
+#define SLAB_ENTRY(l)	list_entry((l), struct slab, next_slab)
+
+static inline int cache_is_page_cache(const struct kmem_cache *cache)
 {
-	arena->max_brk = (vaddr_t)arena + size;
-	arena->cur_brk = arena->data;
-	list_init(&arena->next_arena);
-	list_init(&arena->free_chunks);
-	list_add(&arena_list, &arena->next_arena);
+	return cache->obj_size == PAGE_SIZE;
 }
 
-static inline int arena_can_allocate(struct mem_arena *a, u64 sz)
+static void init_cache(struct kmem_cache *cache, const char *name, u64 size)
 {
-	return ((vaddr_t)a->cur_brk + CHUNK_SIZE(sz) < (vaddr_t)a->max_brk);
+	cache->name = name;
+	cache->obj_size = __align_n(size - 1, 8);
+	cache->objs_per_slab = (SLAB_SIZE - SLAB_HDR_SIZE) / cache->obj_size;
+	cache->free_pages = NULL;
+	cache->nr_free_pages = 0;
+	cache->nr_slabs = 0;
+	cache->lock = (spinlock_t)SPINLOCK_INIT;
+	memset(cache->magazines, 0, sizeof(cache->magazines));
+	list_init(&cache->partial_slabs);
+	list_init(&cache->next_cache);
+	list_add(&cache_list, &cache->next_cache);
 }
 
-static struct mem_chunk *find_free_chunk(struct mem_arena *arena, u64 size)
+static struct slab *new_slab(struct kmem_cache *cache)
 {
-	if (list_empty(&arena->free_chunks))
+	struct slab *slab = alloc_pages(SLAB_PAGES);
+	if (slab == NULL)
 		return NULL;
 
-	struct mem_chunk *cur_chunk;
-	list_for_each_entry(&arena->free_chunks, cur_chunk, free_chunks) {
-		if (cur_chunk->size >= size)
-			break;
+	slab->cache = cache;
+	slab->free_objs = NULL;
+	slab->nr_free = cache->objs_per_slab;
+
+	/* Thread the free list so the first object is handed out first */
+	u8 *obj = (u8 *)slab + SLAB_HDR_SIZE
+		  + (cache->objs_per_slab - 1) * cache->obj_size;
+	for (u32 i = 0; i < cache->objs_per_slab; ++i, obj -= cache->obj_size) {
+		*(void **)obj = slab->free_objs;
+		slab->free_objs = obj;
 	}
 
-	/* we found a free chunk that has enough space */
-	if ((vaddr_t)&cur_chunk->free_chunks != (vaddr_t)&arena->free_chunks
-	    && cur_chunk->size >= size) {
-		list_remove(&cur_chunk->free_chunks);
-		return cur_chunk;
+	list_init(&slab->next_slab);
+	list_add(&cache->partial_slabs, &slab->next_slab);
+	cache->nr_slabs++;
+	return slab;
+}
+
+static inline struct slab *obj_to_slab(const void *obj)
+{
+	return (struct slab *)__align((vaddr_t)obj, SLAB_SIZE);
+}
+
+static void *cache_alloc_page(struct kmem_cache *cache)
+{
+	void *page = cache->free_pages;
+	if (page == NULL)
+		return alloc_page();
+
+	cache->free_pages = *(void **)page;
+	cache->nr_free_pages--;
+	return page;
+}
+
+static void cache_free_page(struct kmem_cache *cache, void *page)
+{
+	if (cache->nr_free_pages >= KMEM_CACHE_MAX_FREE_PAGES) {
+		release_page(page);
+		return;
 	}
 
-	return NULL;
+	*(void **)page = cache->free_pages;
+	cache->free_pages = page;
+	cache->nr_free_pages++;
 }
 
-static struct mem_chunk *arena_allocate_chunk(struct mem_arena *arena, u64 size)
+static void *__kmem_cache_alloc(struct kmem_cache *cache)
 {
-	struct mem_chunk *chunk = arena->cur_brk;
-	arena->cur_brk = (vaddr_t)arena->cur_brk + CHUNK_SIZE(size);
-	chunk->size = size;
-	list_init(&chunk->free_chunks);
-	return chunk;
+	if (cache_is_page_cache(cache))
+		return cache_alloc_page(cache);
+
+	struct slab *slab;
+	if (list_empty(&cache->partial_slabs))
+		slab = new_slab(cache);
+	else
+		slab = SLAB_ENTRY(cache->partial_slabs.next);
+	if (slab == NULL)
+		return NULL;
+
+	void *obj = slab->free_objs;
+	slab->free_objs = *(void **)obj;
+
+	/* Full slabs are only tracked by their objects */
+	if (--slab->nr_free == 0)
+		list_remove(&slab->next_slab);
+	return obj;
 }
 
-void *kmalloc(u64 size)
+static void slab_free(struct slab *slab, void *obj)
 {
-	if (__align(size, 8) != size)
-		size = __align_n(size, 8);
-	struct mem_arena *arena;
-	list_for_each_entry(&arena_list, arena, next_arena) {
-		struct mem_chunk *chunk = find_free_chunk(arena, size);
-		if (chunk != NULL)
-			return (void *)(chunk + 1);
-		/*
-		 * No free chunk in this arena, check if we can
-		 * allocate a new chunk
-		 */
-		if (!arena_can_allocate(arena, size))
-			continue;
+	struct kmem_cache *cache = slab->cache;
+
+	*(void **)obj = slab->free_objs;
+	slab->free_objs = obj;
+
+	if (slab->nr_free++ == 0)
+		list_add(&cache->partial_slabs, &slab->next_slab);
+
+	/* Give empty slabs back, but keep the last one around */
+	if (slab->nr_free == cache->objs_per_slab
+	    && cache->partial_slabs.next != cache->partial_slabs.prev) {
+		list_remove(&slab->next_slab);
+		release_pages(slab, SLAB_PAGES);
+		cache->nr_slabs--;
+	}
+}
+
+static void __kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	if (cache_is_page_cache(cache))
+		cache_free_page(cache, obj);
+	else
+		slab_free(obj_to_slab(obj), obj);
+}
 
-		/* We can allocate a new chunk in this arena */
-		chunk = arena_allocate_chunk(arena, size);
-		return (void *)(chunk + 1);
+static void *magazine_alloc(struct kmem_cache *cache)
+{
+	struct magazine *mag = &cache->magazines[cpu_id()];
+	if (mag->count == 0) {
+		spin_lock(&cache->lock);
+		while (mag->count < MAGAZINE_BATCH) {
+			void *obj = __kmem_cache_alloc(cache);
+			if (obj == NULL)
+				break;
+			mag->objs[mag->count++] = obj;
+		}
+		spin_unlock(&cache->lock);
+
+		if (mag->count == 0)
+			return NULL;
+	}
+	mag->allocs++;
+	return mag->objs[--mag->count];
+}
+
+static void magazine_free(struct kmem_cache *cache, void *obj)
+{
+	struct magazine *mag = &cache->magazines[cpu_id()];
+	if (mag->count == MAGAZINE_SIZE) {
+		spin_lock(&cache->lock);
+		while (mag->count > MAGAZINE_BATCH)
+			__kmem_cache_free(cache, mag->objs[--mag->count]);
+		spin_unlock(&cache->lock);
 	}
+	mag->frees++;
+	mag->objs[mag->count++] = obj;
+}
+
+static void *cache_alloc(struct kmem_cache *cache, const void *site)
+{
+	void *obj = magazine_alloc(cache);
+	if (obj != NULL) {
+		usage_add(&kmalloc_usage, cache->obj_size);
+		alloc_site_account(&kmalloc_sites, site, 0);
+	}
+	return obj;
+}
 
-	/* We found no available memory on existing arenas */
-	u64 nb_page = (sizeof(struct mem_arena) + CHUNK_SIZE(size))
-		      / ARENA_SIZE + 1;
-	/* out of memory */
-	if ((arena = alloc_pages(nb_page)) == NULL)
+static void cache_free(struct kmem_cache *cache, void *obj, const void *site)
+{
+	usage_sub(&kmalloc_usage, cache->obj_size);
+	alloc_site_account(&kmalloc_sites, site, 1);
+	magazine_free(cache, obj);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	return cache_alloc(cache, __builtin_return_address(0));
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+	if (obj != NULL)
+		cache_free(cache, obj, __builtin_return_address(0));
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, u64 size)
+{
+	if (size == 0 || (size > SLAB_SIZE - SLAB_HDR_SIZE && size != PAGE_SIZE))
+		return NULL;
+
+	struct kmem_cache *cache = cache_alloc(&cache_cache,
+					      __builtin_return_address(0));
+	if (cache == NULL)
 		return NULL;
-	init_arena(arena, nb_page * ARENA_SIZE);
-	struct mem_chunk *chk = arena_allocate_chunk(arena, size);
-	return (void *)(chk + 1);
+	init_cache(cache, name, size);
+	return cache;
+}
+
+/* Size class index of `size`, classes are 2^k and 1.5 * 2^k */
+static inline u32 kmalloc_class(u64 size)
+{
+	if (size <= KMALLOC_MIN_SIZE)
+		return 0;
+
+	const u32 shift = 64 - __builtin_clzll(size - 1);
+	if (size <= (3ULL << (shift - 2)))
+		return 2 * (shift - KMALLOC_MIN_SHIFT) - 1;
+	return 2 * (shift - KMALLOC_MIN_SHIFT);
+}
+
+static inline u64 kmalloc_class_size(u32 class)
+{
+	if (class & 1)
+		return (KMALLOC_MIN_SIZE + KMALLOC_MIN_SIZE / 2) << (class / 2);
+	return KMALLOC_MIN_SIZE << (class / 2);
+}
+
+/*
+ * Allocations above the largest size class go straight to the page
+ * allocator, their size is kept in the first frame's metadata.
+ */
+static void *kmalloc_large(u64 size, const void *site)
+{
+	const u64 nr_pages = __align_n(size - 1, PAGE_SIZE) >> PAGE_SHIFT;
+	void *p = alloc_pages(nr_pages);
+	if (p == NULL)
+		return NULL;
+
+	frame_set_large(phys_to_page(virt_to_phys(p)), nr_pages);
+	usage_add(&kmalloc_usage, nr_pages * PAGE_SIZE);
+	alloc_site_account(&kmalloc_sites, site, 0);
+	return p;
+}
+
+void *kmalloc(u64 size)
+{
+	const void *site = __builtin_return_address(0);
+	if (size == 0)
+		return NULL;
+	if (size > KMALLOC_MAX_SIZE)
+		return kmalloc_large(size, site);
+	return cache_alloc(&kmalloc_caches[kmalloc_class(size)], site);
 }
 
 void kfree(void *p)
 {
+	const void *site = __builtin_return_address(0);
 	if (p == NULL)
 		return;
-	struct mem_chunk *chunk = (vaddr_t)p - sizeof(struct mem_chunk);
-	struct mem_arena *arena = __align((vaddr_t)chunk, ARENA_SIZE);
-	list_add(&arena->free_chunks, &chunk->free_chunks);
+
+	struct page_frame *f = phys_to_page(virt_to_phys(p));
+	const u64 nr_pages = frame_large_pages(f);
+	if (nr_pages == 0) {
+		cache_free(obj_to_slab(p)->cache, p, site);
+		return;
+	}
+
+	frame_set_large(f, 0);
+	usage_sub(&kmalloc_usage, nr_pages * PAGE_SIZE);
+	alloc_site_account(&kmalloc_sites, site, 1);
+	release_pages(p, nr_pages);
 }
 
 int init_kmalloc(void)
 {
-	struct mem_arena *first_arena = alloc_huge_page();
-	if (first_arena == NULL)
-		return 1;
-	init_arena(first_arena, ARENA_SIZE);
+	init_cache(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+	for (u32 i = 0; i < NR_KMALLOC_CLASSES; ++i)
+		init_cache(&kmalloc_caches[i], "kmalloc", kmalloc_class_size(i));
 	return 0;
 }
+
+/* Free objects of the partial slabs, that memory is only usable by the cache */
+static u64 cache_stranded_objs(struct kmem_cache *cache)
+{
+	struct slab *slab;
+	u64 res = 0;
+
+	spin_lock(&cache->lock);
+	list_for_each_entry(&cache->partial_slabs, slab, next_slab)
+		res += slab->nr_free;
+	spin_unlock(&cache->lock);
+	return res;
+}
+
+void dump_kmalloc_stats(void)
+{
+	struct kmem_cache *cache;
+
+	printf("kmalloc: %llu bytes used, %llu peak\n", kmalloc_usage.used,
+	       kmalloc_usage.peak);
+	list_for_each_entry(&cache_list, cache, next_cache) {
+		u64 allocs = 0, frees = 0, cached = 0;
+		for (u32 cpu = 0; cpu < NR_CPUS; ++cpu) {
+			allocs += cache->magazines[cpu].allocs;
+			frees += cache->magazines[cpu].frees;
+			cached += cache->magazines[cpu].count;
+		}
+		if (allocs == 0 && cache->nr_slabs == 0)
+			continue;
+
+		printf("  %s-%llu: %llu in use, %llu allocs, %llu slabs, "
+		       "%llu cached, %llu stranded\n", cache->name,
+		       cache->obj_size, allocs - frees, allocs, cache->nr_slabs,
+		       cached + cache->nr_free_pages,
+		       cache_is_page_cache(cache) ? 0 : cache_stranded_objs(cache));
+	}
+	alloc_sites_dump(&kmalloc_sites);
+}
@@ -7,6 +7,7 @@
 #include <page.h>
 #include <pci.h>
 #include <panic.h>
+#include <percpu.h>
 #include <memory.h>
 #include <kmalloc.h>
 #include <vmx.h>
@@ -124,6 +125,7 @@ void hyper_main(u32 magic, u32 info_addr)
 #endif
 	init_idt();
 	load_tss();
+	percpu_init(0);
 
 	memory_init(mmap, va(mod->mod_end));
 	init_kmalloc();
@@ -134,7 +136,11 @@ void hyper_main(u32 magic, u32 info_addr)
 #endif
 
 	struct vmm vmm = {
+#ifdef STRIDE_BENCH_GUEST
+		.setup_guest = setup_stride_bench_guest,
+#else
 		.setup_guest = setup_linux_guest,
+#endif
 		.guest_img = {
 			.start = phys_to_virt(mod->mod_start),
 			.end   = phys_to_virt(mod->mod_end),
@@ -0,0 +1,57 @@
+#include <compact.h>
+#include <compiler.h>
+#include <mem_stats.h>
+#include <stdio.h>
+
+static inline u32 site_hash(const void *site)
+{
+	return ((u64)site * 0x9e3779b97f4a7c15ULL) >> 57;	/* 7 bits */
+}
+
+/* Lock free: a slot is claimed once and never released */
+void alloc_site_account(struct alloc_sites *sites, const void *site, int free)
+{
+	const u32 hash = site_hash(site);
+	for (u32 i = 0; i < NR_ALLOC_SITES; ++i) {
+		struct alloc_site *s = &sites->sites[(hash + i) % NR_ALLOC_SITES];
+		const void *cur = __atomic_load_n(&s->site, __ATOMIC_RELAXED);
+		if (cur == NULL) {
+			__atomic_compare_exchange_n(&s->site, &cur, site, 0,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED);
+			if (cur == NULL)
+				cur = site;
+		}
+		if (cur != site)
+			continue;
+
+		__atomic_add_fetch(free ? &s->frees : &s->allocs, 1,
+				   __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&sites->untracked, 1, __ATOMIC_RELAXED);
+}
+
+void alloc_sites_dump(const struct alloc_sites *sites)
+{
+	for (u32 i = 0; i < NR_ALLOC_SITES; ++i) {
+		const struct alloc_site *s = &sites->sites[i];
+		if (s->site != NULL)
+			printf("  %p: %llu allocs, %llu frees\n", s->site,
+			       s->allocs, s->frees);
+	}
+	if (sites->untracked)
+		printf("  other sites: %llu\n", sites->untracked);
+}
+
+void dump_mem_stats(void)
+{
+	dump_page_stats();
+	dump_kmalloc_stats();
+
+	const struct compact_stats *stats = compact_get_stats();
+	printf("Compaction: %llu passes, %llu migrated, %llu failed, "
+	       "%llu 2M blocks recovered, %llu skipped\n", stats->passes,
+	       stats->migrated, stats->failed, stats->recovered,
+	       stats->skipped);
+}
@@ -0,0 +1,104 @@
+#include <compiler.h>
+#include <kmalloc.h>
+#include <memslot.h>
+#include <string.h>
+
+/* Legacy video and BIOS area, backed like RAM but reserved */
+#define LEGACY_HOLE_START	0xa0000ULL
+#define LEGACY_HOLE_END		0x100000ULL
+
+int memslot_add(struct memslots *memslots, gpa_t base, u64 size,
+		hva_t backing, u32 flags)
+{
+	if (memslots->nr_slots == NR_MEMSLOTS || size == 0)
+		return 1;
+
+	u32 i = 0;
+	for (; i < memslots->nr_slots; ++i) {
+		const struct memslot *slot = &memslots->slots[i];
+		if (base < slot->base + slot->size && slot->base < base + size)
+			return 1;
+		if (base < slot->base)
+			break;
+	}
+
+	hva_t *huge_hva = NULL;
+	if (!backing) {
+		const u64 sz = (((base + size - 1) >> PMD_SHIFT)
+				- (base >> PMD_SHIFT) + 1) * sizeof(hva_t);
+		huge_hva = kmalloc(sz);
+		if (huge_hva == NULL)
+			return 1;
+		memset(huge_hva, 0, sz);
+	}
+
+	for (u32 j = memslots->nr_slots; j > i; --j)
+		memslots->slots[j] = memslots->slots[j - 1];
+
+	struct memslot *slot = &memslots->slots[i];
+	slot->base = base;
+	slot->size = size;
+	slot->backing = backing;
+	slot->flags = flags;
+	slot->huge_hva = huge_hva;
+	slot->dirty_bitmap = NULL;
+	memslots->nr_slots++;
+	memslots->last = i;
+	return 0;
+}
+
+struct memslot *memslot_find(struct memslots *memslots, gpa_t gpa)
+{
+	struct memslot *slot = &memslots->slots[memslots->last];
+	if (memslots->nr_slots && memslot_contains(slot, gpa))
+		return slot;
+
+	for_each_memslot(memslots, slot) {
+		if (memslot_contains(slot, gpa)) {
+			memslots->last = slot - memslots->slots;
+			return slot;
+		}
+	}
+	return NULL;
+}
+
+void memslot_mark_dirty(struct memslot *slot, gpa_t gpa, u64 len)
+{
+	const u64 first = (gpa - slot->base) >> PAGE_SHIFT;
+	const u64 last = (gpa + len - 1 - slot->base) >> PAGE_SHIFT;
+	for (u64 i = first; i <= last; ++i)
+		__atomic_or_fetch(&slot->dirty_bitmap[i / 64], 1ULL << (i % 64),
+				  __ATOMIC_RELAXED);
+}
+
+void memslots_clear(struct memslots *memslots)
+{
+	struct memslot *slot;
+	for_each_memslot(memslots, slot) {
+		kfree(slot->huge_hva);
+		kfree(slot->dirty_bitmap);
+	}
+	memslots->nr_slots = 0;
+	memslots->last = 0;
+}
+
+int memslots_add_ram(struct memslots *memslots, u64 ram_size)
+{
+	const u64 low_end = min(ram_size, MMIO_HOLE_START);
+	if (low_end <= LEGACY_HOLE_END)
+		return 1;
+
+	if (memslot_add(memslots, 0, LEGACY_HOLE_START, 0, 0))
+		return 1;
+	if (memslot_add(memslots, LEGACY_HOLE_START,
+			LEGACY_HOLE_END - LEGACY_HOLE_START, 0,
+			MEMSLOT_RESERVED))
+		return 1;
+	if (memslot_add(memslots, LEGACY_HOLE_END, low_end - LEGACY_HOLE_END,
+			0, 0))
+		return 1;
+	if (ram_size > low_end
+	    && memslot_add(memslots, MMIO_HOLE_END, ram_size - low_end, 0, 0))
+		return 1;
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include <compiler.h>
+#include <mmio.h>
+#include <string.h>
+
+int mmio_region_add(struct mmio_regions *mmio, gpa_t base, u64 size,
+		    const struct mmio_ops *ops, void *opaque)
+{
+	if (mmio->nr_regions == NR_MMIO_REGIONS || size == 0)
+		return 1;
+
+	for (u32 i = 0; i < mmio->nr_regions; ++i) {
+		const struct mmio_region *region = &mmio->regions[i];
+		if (base < region->base + region->size
+		    && region->base < base + size)
+			return 1;
+	}
+
+	struct mmio_region *region = &mmio->regions[mmio->nr_regions++];
+	region->base = base;
+	region->size = size;
+	region->ops = ops;
+	region->opaque = opaque;
+	return 0;
+}
+
+struct mmio_region *mmio_region_find(struct mmio_regions *mmio, gpa_t gpa)
+{
+	for (u32 i = 0; i < mmio->nr_regions; ++i) {
+		struct mmio_region *region = &mmio->regions[i];
+		if (region->base <= gpa && gpa - region->base < region->size)
+			return region;
+	}
+	return NULL;
+}
+
+#define REX_W	(1 << 3)
+#define REX_R	(1 << 2)
+
+/* Skip the ModRM, SIB and displacement bytes of a memory operand */
+static int skip_modrm(const u8 *insn, u64 len, u64 *pos, u8 addr_size,
+		      u8 *reg)
+{
+	if (*pos >= len)
+		return 1;
+
+	const u8 modrm = insn[(*pos)++];
+	const u8 mod = modrm >> 6;
+	const u8 rm = modrm & 7;
+	*reg = (modrm >> 3) & 7;
+
+	/* A register operand cannot be the MMIO access */
+	if (mod == 3)
+		return 1;
+
+	u8 disp = 0;
+	if (addr_size == 2) {
+		if (mod == 1)
+			disp = 1;
+		else if (mod == 2 || (mod == 0 && rm == 6))
+			disp = 2;
+	} else {
+		u8 base = rm;
+		if (rm == 4) {
+			if (*pos >= len)
+				return 1;
+			base = insn[(*pos)++] & 7;
+		}
+		if (mod == 1)
+			disp = 1;
+		else if (mod == 2 || (mod == 0 && base == 5))
+			disp = 4;
+	}
+
+	*pos += disp;
+	return *pos > len;
+}
+
+static u64 read_imm(const u8 *p, u8 size)
+{
+	u64 imm = 0;
+	for (u8 i = 0; i < size; ++i)
+		imm |= (u64)p[i] << (i * 8);
+	return imm;
+}
+
+int mmio_decode(const u8 *insn, u64 len, u8 mode, struct mmio_insn *mi)
+{
+	u8 op_size = mode == 2 ? 2 : 4;
+	u8 addr_size = mode;
+	u8 rex = 0;
+	u64 pos = 0;
+
+	memset(mi, 0, sizeof(*mi));
+
+	for (; pos < len; ++pos) {
+		switch (insn[pos]) {
+		case 0x66:
+			op_size = mode == 2 ? 4 : 2;
+			continue;
+		case 0x67:
+			addr_size = mode == 4 ? 2 : 4;
+			continue;
+		/* Segment overrides and LOCK */
+		case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64:
+		case 0x65: case 0xf0:
+			continue;
+		}
+		break;
+	}
+
+	if (mode == 8 && pos < len && (insn[pos] & 0xf0) == 0x40)
+		rex = insn[pos++];
+	if (rex & REX_W)
+		op_size = 8;
+	if (pos >= len)
+		return 1;
+
+	u16 opcode = insn[pos++];
+	if (opcode == 0x0f) {
+		if (pos >= len)
+			return 1;
+		opcode = 0x0f00 | insn[pos++];
+	}
+
+	switch (opcode) {
+	case 0x88:	/* MOV r/m8, r8 */
+	case 0x8a:	/* MOV r8, r/m8 */
+		mi->size = 1;
+		break;
+	case 0x89:	/* MOV r/m, r */
+	case 0x8b:	/* MOV r, r/m */
+	case 0xc7:	/* MOV r/m, imm */
+		mi->size = op_size;
+		break;
+	case 0xc6:	/* MOV r/m8, imm8 */
+	case 0x0fb6:	/* MOVZX r, r/m8 */
+		mi->size = 1;
+		break;
+	case 0x0fb7:	/* MOVZX r, r/m16 */
+		mi->size = 2;
+		break;
+	default:
+		return 1;
+	}
+
+	u8 reg;
+	if (skip_modrm(insn, len, &pos, addr_size, &reg))
+		return 1;
+	mi->reg = reg | (rex & REX_R ? 8 : 0);
+	mi->write = opcode == 0x88 || opcode == 0x89 || opcode == 0xc6
+		    || opcode == 0xc7;
+	mi->reg_size = opcode == 0x8a ? 1 : op_size;
+
+	/* Without REX, byte registers 4 to 7 are AH, CH, DH and BH */
+	if ((opcode == 0x88 || opcode == 0x8a) && !rex && reg >= 4) {
+		mi->reg = reg - 4;
+		mi->high_byte = 1;
+	}
+
+	if (opcode == 0xc6 || opcode == 0xc7) {
+		if (reg != 0)
+			return 1;
+		const u8 imm_size = min(mi->size, 4);
+		if (pos + imm_size > len)
+			return 1;
+		mi->imm_op = 1;
+		mi->imm = read_imm(insn + pos, imm_size);
+		/* imm32 is sign extended to 64 bits */
+		if (mi->size == 8 && (mi->imm & (1ULL << 31)))
+			mi->imm |= 0xffffffff00000000ULL;
+		pos += imm_size;
+	}
+
+	mi->len = pos;
+	return 0;
+}
@@ -1,63 +1,78 @@
+#include <compact.h>
 #include <compiler.h>
+#include <mem_stats.h>
 #include <page.h>
+#include <percpu.h>
+#include <spinlock.h>
 #include <stdio.h>
 
-static DECLARE_LIST(frame_free_list);
-
-#define MAX_MEMORY_ZONES 20
-struct memory_map {
-	struct mem_zone zones[MAX_MEMORY_ZONES];
-	u8 zone_cnt;
-};
-
-static struct memory_map memory_map = {
+struct memory_map memory_map = {
+	.zones = NULL,
 	.zone_cnt = 0,
 };
 
-struct frame_state {
-	struct page_frame *begin;	/* Start of the frame array */
-	struct page_frame *end;		/* End of the frame array */
-	u64 last_pfn;			/* Last valid page frame number */
-};
-
-static struct frame_state frame_state;
-
-/* Kernel start */
-extern char _start[];
+/* Frame allocator backend */
+static spinlock_t frame_lock = SPINLOCK_INIT;
 
 #define LOW_MEM_END 	(1 << 20)
 #define _2M_PAGE_SIZE	(2 * BIG_PAGE_SIZE)
 
-/* ATM only get available regions */
-static void init_memory_map(struct multiboot_tag_mmap *mmap)
+#define for_each_mmap_entry(m, mmap)					\
+	for (m = (mmap)->entries;					\
+	     (u64)m < (u64)(mmap) + (mmap)->size;			\
+	     m = (void *)((u8 *)m + (mmap)->entry_size))
+
+/* End of the last available region the direct map can cover */
+static paddr_t mmap_last_paddr(struct multiboot_tag_mmap *mmap)
 {
-	multiboot_memory_map_t *m = mmap->entries;
-	u64 end = (u64)mmap + mmap->size;
+	multiboot_memory_map_t *m;
+	paddr_t res = 0;
+
+	for_each_mmap_entry(m, mmap) {
+		if (m->type == MULTIBOOT_MEMORY_AVAILABLE && m->addr + m->len > res)
+			res = m->addr + m->len;
+	}
+	return res < PHYS_MAP_MAX_SIZE ? res : PHYS_MAP_MAX_SIZE;
+}
+
+/*
+ * ATM only get available regions. The zone table is placed at `table`,
+ * returns the end of the table.
+ */
+static vaddr_t init_memory_map(struct multiboot_tag_mmap *mmap, vaddr_t table)
+{
+	multiboot_memory_map_t *m;
 
-	for (; (u64)m < end; m = (void *)((u8 *)m + mmap->entry_size)) {
+	memory_map.zones = (struct mem_zone *)table;
+	for_each_mmap_entry(m, mmap) {
 		struct mem_zone *zone = &memory_map.zones[memory_map.zone_cnt];
 		if (m->type != MULTIBOOT_MEMORY_AVAILABLE)
 			continue;
+
+		/* RAM outside of the direct map is unusable */
+		if (m->addr >= PHYS_MAP_MAX_SIZE) {
+			printf("Ignoring RAM above %llu GiB\n", PHYS_MAP_MAX_SIZE >> 30);
+			continue;
+		}
+
 		zone->start = m->addr;
 		zone->length = m->len;
 		zone->type = MEM_RAM_USABLE;
+		if (zone->start + zone->length > PHYS_MAP_MAX_SIZE)
+			zone->length = PHYS_MAP_MAX_SIZE - zone->start;
 
 		if (zone->start + zone->length < LOW_MEM_END)
 			zone->type |= MEM_LOW_MEM;
 
 		memory_map.zone_cnt++;
 	}
+	return (vaddr_t)(memory_map.zones + memory_map.zone_cnt);
 }
 
-static inline int mem_is_usable(const u8 type)
-{
-	return type & MEM_RAM_USABLE;
-}
-
-static paddr_t first_valid_paddr(void)
+paddr_t first_valid_paddr(void)
 {
 	paddr_t res = MAX_PHYS_ADDR;
-	for (u8 i = 0; i < memory_map.zone_cnt; ++i) {
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i) {
 		const struct mem_zone *tmp = &memory_map.zones[i];
 		if (mem_is_usable(tmp->type) && tmp->start < res)
 			res = tmp->start;
@@ -65,10 +80,10 @@ static paddr_t first_valid_paddr(void)
 	return res;
 }
 
-static paddr_t last_valid_paddr(void)
+paddr_t last_valid_paddr(void)
 {
 	paddr_t res = 0;
-	for (u8 i = 0; i < memory_map.zone_cnt; ++i) {
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i) {
 		const struct mem_zone *tmp = &memory_map.zones[i];
 		if (mem_is_usable(tmp->type) && tmp->start + tmp->length > res)
 			res = tmp->start + tmp->length;
@@ -76,9 +91,9 @@ static paddr_t last_valid_paddr(void)
 	return res;
 }
 
-static u8 paddr_mem_type(paddr_t paddr)
+u8 paddr_mem_type(paddr_t paddr)
 {
-	for (u8 i = 0; i < memory_map.zone_cnt; ++i) {
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i) {
 		const struct mem_zone *tmp = &memory_map.zones[i];
 		if (paddr >= tmp->start && paddr < tmp->start + tmp->length)
 			return tmp->type;
@@ -86,24 +101,70 @@ static u8 paddr_mem_type(paddr_t paddr)
 	return MEM_RESERVED;
 }
 
-/* Setup 4G physical memory map starting from virtual addr PHYS_MAP_START */
-static void setup_phys_map(void)
+#define PHYS_MAP_MIN_SIZE	(4ULL << 30)	/* Keep the low MMIO mapped */
+
+/* One PUD per 512G of direct map, they have to exist before any allocator */
+static pud_t phys_map_puds[PHYS_MAP_MAX_SIZE / PGD_SIZE][PTRS_PER_TABLE]
+	__aligned(PAGE_SIZE);
+
+/* Map [0, end) from virtual addr PHYS_MAP_START with 1G pages */
+static void setup_phys_map(paddr_t end)
 {
-	pud_t *pud = kernel_pud();
-	for (vaddr_t va = PHYS_MAP_START; va < PHYS_MAP_END; va += (1 << 30))
-		pud[pud_offset(va)] = pte_rw_huge(virt_to_phys(va));
+	pgd_t *pgd = kernel_pgd();
+
+	if (end < PHYS_MAP_MIN_SIZE)
+		end = PHYS_MAP_MIN_SIZE;
+	end = __align_n(end - 1, PUD_SIZE);
+
+	for (paddr_t paddr = 0; paddr < end; paddr += PUD_SIZE) {
+		const vaddr_t va = phys_to_virt(paddr);
+		pud_t *pud = phys_map_puds[paddr >> PGD_SHIFT];
+		if (pud_offset(va) == 0)
+			pgd[pgd_offset(va)] = virt_to_phys((vaddr_t)pud)
+					      | PG_PRESENT | PG_WRITABLE;
+		pud[pud_offset(va)] = pte_rw_huge(paddr);
+	}
+	printf("Direct map: %llu GiB\n", end >> 30);
 }
 
+#ifndef FRAME_BITMAP
+/*
+ * The frame array is initialized one 1G section at a time: only the first
+ * sections are set up at boot, the others by finish_frame_init(), once
+ * the boot critical path is over. Buddy blocks never cross a section, so
+ * merging never looks at frames of a section that is not initialized yet.
+ * Boot goes on until FRAME_BOOT_RESERVE bytes are free, some of them as
+ * 2M blocks, enough to load the guest: the frame array alone can fill the
+ * first section of a large host.
+ */
+#define SECTION_ORDER		MAX_ORDER
+#define FRAMES_PER_SECTION	(1ULL << SECTION_ORDER)
+#define FRAME_BOOT_RESERVE	MB(256)
+
+struct frame_state {
+	struct page_frame *begin;	/* Start of the frame array */
+	struct page_frame *end;		/* End of the frame array */
+	u64 last_pfn;			/* Last valid page frame number */
+	u64 nb_sections;
+	u64 next_section;		/* First section not initialized */
+	u64 boot_cycles;		/* TSC cycles of the boot time init */
+};
+
+static struct frame_state frame_state;
+
 static void init_frame_state(struct frame_state *state, vaddr_t mod_end)
 {
-	const paddr_t first_paddr = __align(first_valid_paddr(), PAGE_SIZE);
+	/* The frame array is indexed by pfn, starting from 0 */
 	const paddr_t last_paddr = __align(last_valid_paddr(), PAGE_SIZE);
-	const u64 nb_frames = (last_paddr - first_paddr) / PAGE_SIZE;
+	const u64 nb_frames = last_paddr / PAGE_SIZE;
 
 	/* Use PHYS_MAP mapping for the frame array */
 	state->begin = (struct page_frame *)phys_to_virt(virt_to_phys(mod_end));
 	state->end = state->begin + nb_frames;
 	state->last_pfn = nb_frames - 1;
+	state->nb_sections = (nb_frames + FRAMES_PER_SECTION - 1) / FRAMES_PER_SECTION;
+	state->next_section = 0;
+	state->boot_cycles = 0;
 }
 
 paddr_t page_to_phys(const struct page_frame *frame)
@@ -116,104 +177,540 @@ struct page_frame *phys_to_page(const paddr_t paddr)
 	return frame_state.begin + (paddr >> PAGE_SHIFT);
 }
 
+struct page_frame *pfn_to_page(u64 pfn)
+{
+	return frame_state.begin + pfn;
+}
+
+static inline u64 page_to_pfn(const struct page_frame *frame)
+{
+	return frame - frame_state.begin;
+}
+
 static inline void init_page_frame(struct page_frame *f)
 {
 	list_init(&f->free_list);
-	f->vaddr = (vaddr_t)NULL;
+	f->order = 0;
+	f->flags = 0;
+}
+
+/*
+ * Binary buddy allocator: free_areas[order] holds the free blocks of
+ * 2^order frames, every block being naturally aligned on its size.
+ * Only the first frame of a free block is on a list and has FRAME_FREE.
+ */
+struct free_area {
+	struct list free_list;
+	u64 nr_free;
+};
+
+static struct free_area free_areas[MAX_ORDER + 1];
+
+#define PAGE_FRAME_ENTRY(l)	list_entry((l), struct page_frame, free_list)
+
+static inline int frame_is_free(const struct page_frame *f)
+{
+	return f->flags & FRAME_FREE;
+}
+
+static void free_area_add(struct page_frame *f, u32 order)
+{
+	f->order = order;
+	f->flags |= FRAME_FREE;
+	list_add(&free_areas[order].free_list, &f->free_list);
+	free_areas[order].nr_free++;
+}
+
+static void free_area_remove(struct page_frame *f)
+{
+	list_remove(&f->free_list);
+	free_areas[f->order].nr_free--;
+	f->flags &= ~FRAME_FREE;
+}
+
+static inline u64 buddy_pfn(u64 pfn, u32 order)
+{
+	return pfn ^ (1ULL << order);
+}
+
+/* Free the 2^order frames block at `pfn` and merge it with its buddies */
+static void free_block(u64 pfn, u32 order)
+{
+	for (; order < MAX_ORDER; ++order) {
+		const u64 buddy = buddy_pfn(pfn, order);
+		if (buddy > frame_state.last_pfn)
+			break;
+
+		struct page_frame *f = pfn_to_page(buddy);
+		if (!frame_is_free(f) || f->order != order)
+			break;
+
+		free_area_remove(f);
+		pfn &= ~(1ULL << order);
+	}
+	free_area_add(pfn_to_page(pfn), order);
+}
+
+/* Largest order a block starting at `pfn` can have (natural alignment) */
+static inline u32 pfn_max_order(u64 pfn)
+{
+	if (pfn == 0)
+		return MAX_ORDER;
+
+	u32 order = __builtin_ctzll(pfn);
+	return order > MAX_ORDER ? MAX_ORDER : order;
 }
 
-static inline int paddr_is_reserved(const paddr_t paddr)
+/* Release [pfn, pfn + n) as the largest possible aligned blocks */
+static void free_range(u64 pfn, u64 n)
 {
-	return (paddr >= virt_to_phys(_start)
-		&& paddr < virt_to_phys(frame_state.end));
+	const u64 end = pfn + n;
+	while (pfn < end) {
+		u32 order = pfn_max_order(pfn);
+		while ((1ULL << order) > end - pfn)
+			--order;
+		free_block(pfn, order);
+		pfn += 1ULL << order;
+	}
+}
+
+/* Free the frames of [start, end) that do not hold the kernel or metadata */
+static void free_unreserved_range(u64 start, u64 end)
+{
+	const u64 reserved_start = virt_to_phys((vaddr_t)_start) >> PAGE_SHIFT;
+	const u64 reserved_end = (virt_to_phys((vaddr_t)frame_state.end)
+				  + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	if (start < reserved_start)
+		free_range(start, min(end, reserved_start) - start);
+	if (end > reserved_end) {
+		start = max(start, reserved_end);
+		free_range(start, end - start);
+	}
+}
+
+static void init_section(u64 section)
+{
+	const u64 first = section * FRAMES_PER_SECTION;
+	const u64 last = min(first + FRAMES_PER_SECTION, frame_state.last_pfn + 1);
+
+	for (u64 pfn = first; pfn < last; ++pfn)
+		init_page_frame(pfn_to_page(pfn));
+
+	/* Hand the usable frames of the section to the buddy allocator */
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i) {
+		const struct mem_zone *zone = &memory_map.zones[i];
+		if (!mem_is_usable(zone->type))
+			continue;
+
+		const u64 start = max((zone->start + PAGE_SIZE - 1) >> PAGE_SHIFT, first);
+		const u64 end = min((zone->start + zone->length) >> PAGE_SHIFT, last);
+		if (start < end)
+			free_unreserved_range(start, end);
+	}
+}
+
+static inline int boot_reserve_available(void)
+{
+	u64 nr_free = 0;
+	int huge = 0;
+	for (u32 order = 0; order <= MAX_ORDER; ++order) {
+		nr_free += free_areas[order].nr_free << order;
+		if (order >= HUGE_PAGE_ORDER && free_areas[order].nr_free)
+			huge = 1;
+	}
+	return huge && nr_free >= FRAME_BOOT_RESERVE / PAGE_SIZE;
+}
+
+/* One section at a time, allocations go on in between */
+void finish_frame_init(void)
+{
+	struct frame_state *state = &frame_state;
+	const u64 nr_deferred = state->nb_sections - state->next_section;
+	if (nr_deferred == 0)
+		return;
+
+	const u64 start = rdtsc();
+	for (;;) {
+		spin_lock(&frame_lock);
+		const int done = state->next_section == state->nb_sections;
+		if (!done)
+			init_section(state->next_section++);
+		spin_unlock(&frame_lock);
+		if (done)
+			break;
+	}
+
+	const u64 cycles = rdtsc() - start;
+	printf("Deferred frame init: %llu sections in %llu cycles, "
+	       "boot init took %llu cycles instead of %llu\n", nr_deferred,
+	       cycles, state->boot_cycles, state->boot_cycles + cycles);
 }
 
-static void setup_frame_state(vaddr_t mod_end)
+void setup_frame_state(vaddr_t mod_end)
 {
 	struct frame_state *state = &frame_state;
 	init_frame_state(state, mod_end);
 
-	for (struct page_frame *f = state->begin; f < state->end; ++f) {
-		init_page_frame(f);
-		const paddr_t paddr = page_to_phys(f);
-		if (!mem_is_usable(paddr_mem_type(paddr)))
-			continue;
-		if (!paddr_is_reserved(paddr))
-			list_add(&frame_free_list, &f->free_list);
+	for (u32 order = 0; order <= MAX_ORDER; ++order) {
+		list_init(&free_areas[order].free_list);
+		free_areas[order].nr_free = 0;
 	}
+
+	const u64 start = rdtsc();
+	while (state->next_section < state->nb_sections
+	       && !boot_reserve_available())
+		init_section(state->next_section++);
+
+	state->boot_cycles = rdtsc() - start;
+	printf("Frame init: %llu cycles, %llu/%llu sections deferred\n",
+	       state->boot_cycles, state->nb_sections - state->next_section,
+	       state->nb_sections);
 }
 
-#define PAGE_FRAME_ENTRY(l)	list_entry((l), struct page_frame, free_list)
-/* Very dummy allocator */
-/* Try to allocates `nb_frames` contiguous frames */
+static inline u32 frames_order(u64 nb_frames)
+{
+	u32 order = 0;
+	while ((1ULL << order) < nb_frames)
+		++order;
+	return order;
+}
+
+/* Allocates `nb_frames` physically contiguous frames */
 struct page_frame *alloc_page_frames(u64 nb_frames)
 {
-	struct list *l;
-	list_for_each_reverse(&frame_free_list, l) {
-		struct page_frame *start = PAGE_FRAME_ENTRY(l);
-		struct page_frame *end;
-		u64 n = nb_frames;
-		for (end = start; end < frame_state.end && n > 0; ++end, --n)
-			if (list_empty(&end->free_list))
-				break;
-		/* No contigous frames found */
-		if (n > 0)
-			continue;
+	if (nb_frames == 0 || nb_frames > (1ULL << MAX_ORDER))
+		return NULL;
+
+	const u32 order = frames_order(nb_frames);
+	u32 cur = order;
+	while (cur <= MAX_ORDER && list_empty(&free_areas[cur].free_list))
+		++cur;
+	if (cur > MAX_ORDER)
+		return NULL;
+
+	struct page_frame *f = PAGE_FRAME_ENTRY(free_areas[cur].free_list.next);
+	free_area_remove(f);
+
+	/* Split the block, giving back the upper halves */
+	const u64 pfn = page_to_pfn(f);
+	while (cur > order) {
+		--cur;
+		free_area_add(pfn_to_page(pfn + (1ULL << cur)), cur);
+	}
 
-		/* Remove frames from free list */
-		for (struct page_frame *f = start; f < end; ++f)
-			list_remove(&f->free_list);
+	/* Give back the tail when nb_frames is not a power of two */
+	if (nb_frames < (1ULL << order))
+		free_range(pfn + nb_frames, (1ULL << order) - nb_frames);
 
-		return start;
-	}
-	return NULL;
+	return f;
 }
 
 void release_page_frames(struct page_frame *f, u64 n)
 {
-	for (u64 i = 0; i < n; ++i)
-		list_add(&frame_free_list, &f[i].free_list);
+	free_range(page_to_pfn(f), n);
+}
+
+u64 frame_metadata_size(void)
+{
+	return (vaddr_t)frame_state.end - (vaddr_t)frame_state.begin;
+}
+
+void frame_set_large(struct page_frame *f, u64 nr_pages)
+{
+	if (nr_pages) {
+		f->flags |= FRAME_LARGE;
+		f->nr_pages = nr_pages;
+	} else {
+		f->flags &= ~FRAME_LARGE;
+	}
+}
+
+u64 frame_large_pages(const struct page_frame *f)
+{
+	return f->flags & FRAME_LARGE ? f->nr_pages : 0;
+}
+
+void frame_set_movable(struct page_frame *f, int movable)
+{
+	if (movable)
+		f->flags |= FRAME_MOVABLE;
+	else
+		f->flags &= ~FRAME_MOVABLE;
+}
+
+int frame_is_movable(const struct page_frame *f)
+{
+	return f->flags & FRAME_MOVABLE;
+}
+
+u64 frame_huge_block_free(u64 pfn)
+{
+	/* Frames of deferred sections are not free yet */
+	if (pfn / FRAMES_PER_SECTION >= frame_state.next_section)
+		return 0;
+
+	const u64 start = pfn & ~((1ULL << HUGE_PAGE_ORDER) - 1);
+	const u64 end = min(start + (1ULL << HUGE_PAGE_ORDER),
+			    frame_state.last_pfn + 1);
+
+	/* The whole block may be part of a larger free block */
+	for (u32 order = HUGE_PAGE_ORDER; order <= MAX_ORDER; ++order) {
+		const struct page_frame *f = pfn_to_page(start & ~((1ULL << order) - 1));
+		if (frame_is_free(f) && f->order >= order)
+			return end - start;
+	}
+
+	u64 nr_free = 0;
+	for (pfn = start; pfn < end; ) {
+		const struct page_frame *f = pfn_to_page(pfn);
+		if (frame_is_free(f)) {
+			nr_free += 1ULL << f->order;
+			pfn += 1ULL << f->order;
+		} else {
+			++pfn;
+		}
+	}
+	return nr_free;
+}
+
+u64 frame_free_huge_blocks(void)
+{
+	u64 res = 0;
+	for (u32 order = HUGE_PAGE_ORDER; order <= MAX_ORDER; ++order)
+		res += free_areas[order].nr_free << (order - HUGE_PAGE_ORDER);
+	return res;
+}
+
+void frame_get_stats(struct frame_stats *stats)
+{
+	stats->nr_free = 0;
+	for (u32 order = 0; order <= MAX_ORDER; ++order) {
+		stats->nr_blocks[order] = free_areas[order].nr_free;
+		stats->nr_free += free_areas[order].nr_free << order;
+	}
+
+	/* Adjacent free blocks that are not buddies still form a run */
+	const u64 limit = min(frame_state.next_section * FRAMES_PER_SECTION,
+			      frame_state.last_pfn + 1);
+	u64 run = 0;
+	stats->largest_run = 0;
+	for (u64 pfn = 0; pfn < limit; ) {
+		const struct page_frame *f = pfn_to_page(pfn);
+		if (frame_is_free(f)) {
+			run += 1ULL << f->order;
+			pfn += 1ULL << f->order;
+			continue;
+		}
+		stats->largest_run = max(stats->largest_run, run);
+		run = 0;
+		++pfn;
+	}
+	stats->largest_run = max(stats->largest_run, run);
+}
+
+/* Free blocks larger than 2M are never split by this */
+struct page_frame *alloc_frame_in_block(u64 pfn)
+{
+	if (pfn / FRAMES_PER_SECTION >= frame_state.next_section)
+		return NULL;
+
+	const u64 start = pfn & ~((1ULL << HUGE_PAGE_ORDER) - 1);
+	const u64 end = min(start + (1ULL << HUGE_PAGE_ORDER),
+			    frame_state.last_pfn + 1);
+	for (pfn = start; pfn < end; ++pfn) {
+		struct page_frame *f = pfn_to_page(pfn);
+		if (!frame_is_free(f))
+			continue;
+
+		const u32 order = f->order;
+		free_area_remove(f);
+		free_range(pfn + 1, (1ULL << order) - 1);
+		return f;
+	}
+	return NULL;
 }
+#endif /* !FRAME_BITMAP */
 
 int memory_init(struct multiboot_tag_mmap *mmap, vaddr_t mod_end)
 {
-	init_memory_map(mmap);
-	setup_phys_map();
-	setup_frame_state(mod_end);
+	setup_phys_map(mmap_last_paddr(mmap));
 
+	/* Zone table then frame allocator metadata, right after the modules */
+	vaddr_t table = phys_to_virt(virt_to_phys(__align_n(mod_end - 1, 8)));
+	setup_frame_state(init_memory_map(mmap, table));
+
+	printf("Frame metadata: %llu KiB\n", frame_metadata_size() >> 10);
 	return 0;
 }
 
+/*
+ * Per-CPU magazines of single frames in front of the frame allocator:
+ * a CPU only takes frame_lock to refill or drain half of its magazine.
+ */
+#define PAGE_MAGAZINE_SIZE	64
+#define PAGE_MAGAZINE_BATCH	(PAGE_MAGAZINE_SIZE / 2)
+
+struct page_magazine {
+	u32 count;
+	struct page_frame *frames[PAGE_MAGAZINE_SIZE];
+} __aligned(CACHELINE_SIZE);
+
+static struct page_magazine page_magazines[NR_CPUS];
+
+static struct page_frame *magazine_alloc_frame(void)
+{
+	struct page_magazine *mag = &page_magazines[cpu_id()];
+	if (mag->count == 0) {
+		spin_lock(&frame_lock);
+		while (mag->count < PAGE_MAGAZINE_BATCH) {
+			struct page_frame *f = alloc_page_frame();
+			if (f == NULL)
+				break;
+			mag->frames[mag->count++] = f;
+		}
+		spin_unlock(&frame_lock);
+
+		if (mag->count == 0)
+			return NULL;
+	}
+	return mag->frames[--mag->count];
+}
+
+static void magazine_release_frame(struct page_frame *f)
+{
+	struct page_magazine *mag = &page_magazines[cpu_id()];
+	if (mag->count == PAGE_MAGAZINE_SIZE) {
+		spin_lock(&frame_lock);
+		while (mag->count > PAGE_MAGAZINE_BATCH)
+			release_page_frame(mag->frames[--mag->count]);
+		spin_unlock(&frame_lock);
+	}
+	mag->frames[mag->count++] = f;
+}
+
+void drain_page_magazines(void)
+{
+	spin_lock(&frame_lock);
+	for (u32 cpu = 0; cpu < NR_CPUS; ++cpu) {
+		struct page_magazine *mag = &page_magazines[cpu];
+		while (mag->count)
+			release_page_frame(mag->frames[--mag->count]);
+	}
+	spin_unlock(&frame_lock);
+}
+
 static inline u64 frames_per_page(u8 flags)
 {
 	return flags & PG_HUGE_PAGE ? 512 : 1;
 }
 
+/* Pages handed out by the functions below, in 4K pages */
+static struct usage_counter page_usage;
+static struct alloc_sites page_sites;
+
+static inline void account_pages(u64 nb_frames, const void *site)
+{
+	usage_add(&page_usage, nb_frames);
+	alloc_site_account(&page_sites, site, 0);
+}
+
 /* Allocate `nb_pages` pages (4K or 2M) */
-static void *__alloc_pages(u64 nb_pages, u8 flags)
+static void *__alloc_pages(u64 nb_pages, u8 flags, const void *site)
 {
-	u64 nb_frames = frames_per_page(flags);
-	
-	/* Try to alloc contiguous physical memory */
-	struct page_frame *frames = alloc_page_frames(nb_pages * nb_frames);
+	u64 nb_frames = frames_per_page(flags) * nb_pages;
+	struct page_frame *frames;
+
+	if (nb_frames == 1) {
+		frames = magazine_alloc_frame();
+	} else {
+		/* Try to alloc contiguous physical memory */
+		spin_lock(&frame_lock);
+		frames = alloc_page_frames(nb_frames);
+		spin_unlock(&frame_lock);
+
+		/*
+		 * Migrating movable pages can free 2M blocks, compact_memory()
+		 * backs off while that fails
+		 */
+		if (frames == NULL && nb_frames >= (1ULL << HUGE_PAGE_ORDER)
+		    && compact_memory()) {
+			spin_lock(&frame_lock);
+			frames = alloc_page_frames(nb_frames);
+			spin_unlock(&frame_lock);
+		}
+	}
 
-	if (frames != NULL)
-		return phys_to_virt(page_to_phys(frames));
-	return NULL;
+	if (frames == NULL)
+		return NULL;
+
+	account_pages(nb_frames, site);
+	return (void *)phys_to_virt(page_to_phys(frames));
 }
 
 void *alloc_huge_pages(u64 nb)
 {
-	return __alloc_pages(nb, PG_HUGE_PAGE);
+	return __alloc_pages(nb, PG_HUGE_PAGE, __builtin_return_address(0));
 }
 
 void *alloc_pages(u64 nb)
 {
-	return __alloc_pages(nb, 0);
+	return __alloc_pages(nb, 0, __builtin_return_address(0));
+}
+
+void *alloc_page_in_block(paddr_t paddr)
+{
+	spin_lock(&frame_lock);
+	struct page_frame *f = alloc_frame_in_block(paddr >> PAGE_SHIFT);
+	spin_unlock(&frame_lock);
+
+	if (f == NULL)
+		return NULL;
+
+	account_pages(1, __builtin_return_address(0));
+	return (void *)phys_to_virt(page_to_phys(f));
+}
+
+void set_page_movable(void *p, int movable)
+{
+	frame_set_movable(phys_to_page(virt_to_phys(p)), movable);
 }
 
 void release_pages(void *p, u64 n)
 {
 	struct page_frame *f = phys_to_page(virt_to_phys(p));
+
+	usage_sub(&page_usage, n);
+	alloc_site_account(&page_sites, __builtin_return_address(0), 1);
+	compact_note_release();
+
+	if (n == 1) {
+		magazine_release_frame(f);
+		return;
+	}
+
+	spin_lock(&frame_lock);
 	release_page_frames(f, n);
+	spin_unlock(&frame_lock);
+}
+
+void dump_page_stats(void)
+{
+	struct frame_stats stats;
+	spin_lock(&frame_lock);
+	frame_get_stats(&stats);
+	spin_unlock(&frame_lock);
+
+	u64 cached = 0;
+	for (u32 cpu = 0; cpu < NR_CPUS; ++cpu)
+		cached += page_magazines[cpu].count;
+
+	printf("Pages: %llu free, %llu cached, %llu used, %llu peak\n",
+	       stats.nr_free, cached, page_usage.used, page_usage.peak);
+	printf("Largest free run: %llu pages\n", stats.largest_run);
+	printf("Free blocks per order:");
+	for (u32 order = 0; order <= MAX_ORDER; ++order)
+		printf(" %llu", stats.nr_blocks[order]);
+	printf("\n");
+	alloc_sites_dump(&page_sites);
 }
@@ -32,6 +32,8 @@ struct pci_dev_descr {
 
 static DECLARE_LIST(pci_drivers);
 
+static struct kmem_cache *pci_dev_cache;
+
 static inline u32 pci_inl(const struct pci_addr addr)
 {
 	outl(PCI_CONFIG_ADDRESS, addr.dword);
@@ -232,7 +234,7 @@ static int pci_bus_enum_dev_func(struct pci_bus *pci_bus, struct pci_addr addr,
 
 	pci_print_config_addr(addr, config);
 
-	struct pci_dev *pci_dev = kmalloc(sizeof(struct pci_dev));
+	struct pci_dev *pci_dev = kmem_cache_alloc(pci_dev_cache);
 	if (pci_dev == NULL)
 		return 1;
 
@@ -300,5 +302,11 @@ static const struct bus_ops pci_bus_ops = {
 
 int init_pci_bus(struct pci_bus *pci_bus)
 {
+	if (pci_dev_cache == NULL)
+		pci_dev_cache = kmem_cache_create("pci_dev",
+						  sizeof(struct pci_dev));
+	if (pci_dev_cache == NULL)
+		return 1;
+
 	return bus_init(&pci_bus->bus, "PCI Bus", &pci_bus_ops);
 }
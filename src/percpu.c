@@ -0,0 +1,16 @@
+#include <panic.h>
+#include <percpu.h>
+#include <stdio.h>
+#include <x86.h>
+
+static struct percpu percpu_areas[NR_CPUS];
+
+void percpu_init(u32 cpu)
+{
+	if (cpu >= NR_CPUS)
+		panic("CPU %u past NR_CPUS\n", cpu);
+
+	struct percpu *area = &percpu_areas[cpu];
+	area->cpu_id = cpu;
+	__writemsr(MSR_GS_BASE, (u64)area);
+}
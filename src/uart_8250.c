@@ -2,6 +2,7 @@
 #include <panic.h>
 #include <stdio.h>
 #include <types.h>
+#include <uart_8250.h>
 #include <vmx.h>
 
 struct uart_8250 {
@@ -27,6 +28,18 @@ struct uart_8250 {
 
 static struct uart_8250 uart_state;
 
+char uart_tx_buf[UART_TX_BUF_SIZE];
+u32 uart_tx_len;
+u64 uart_tx_tsc;
+u8 uart_tx_direct = 1;
+
+void uart_8250_flush(void)
+{
+	for (u32 i = 0; i < uart_tx_len; ++i)
+		printf("%c", uart_tx_buf[i]);
+	uart_tx_len = 0;
+}
+
 /*
  * Here's the 'serial2vga' hack:
  * To test bare-metal without having physical serial, boot linux
@@ -42,6 +55,7 @@ static void emulate_uart_8250_write(u8 val, u16 port)
 			uart->dll = val;
 		} else {
 			uart->thr = val;
+			uart_8250_flush();
 			printf("%c", val);
 		}
 		return;
@@ -56,6 +70,7 @@ static void emulate_uart_8250_write(u8 val, u16 port)
 		return;
 	case 3:
 		uart->lcr = val;
+		uart_tx_direct = !(val & UART_LCR_DLAB);
 		return;
 	case 4:
 		uart->mcr = val;
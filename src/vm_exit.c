@@ -1,54 +1,312 @@
 #include <cpuid.h>
 
+#include <exit_stats.h>
+#include <guest_mem.h>
+#include <hypercall.h>
 #include <io.h>
 #include <interrupts.h>
+#include <memory.h>
+#include <mem_stats.h>
+#include <mmio.h>
 #include <page.h>
 #include <panic.h>
+#include <uart_8250.h>
 #include <vmx.h>
 
-asm (
-	".global vm_exit_stub\n\t"
-	"vm_exit_stub:\n\t"
-	"subq	$16, %rsp\n\t"
-	PUSH_ALL_REGS_STR
-	"movq	0xa0(%rsp), %rdi\n\t"
-	"movq	%rsp, %rsi\n\t"
-	"callq	vm_exit_dispatch\n\t"
-	POP_ALL_REGS_STR
-	"addq	$16, %rsp\n\t"
-	"vmresume\n\t"
-	"jbe error_handler\n\t"
-);
-
-struct vm_exit_code {
-	union {
-		struct {
-			u16	exit_reason;
-			u32	reserved1 : 11;
-			u32	enclave : 1;
-			u32	pending_mtf : 1;
-			u32	vmx_root : 1;
-			u32	reserved2 : 1;
-			u32	vm_entry : 1;
-		};
-		u32	dword;
-	};
-} __packed;
-
-struct vm_exit_ctx {
-	struct x86_regs 	regs;
-	u64			exit_qual;
-	struct vm_exit_code 	exit_code;
-} __packed;
-
 typedef void (*vm_exit_handler_t)(struct vmm *vmm,
 				  struct vm_exit_ctx *ctx);
 
+#define INTR_OR_NMI_EXIT_NO	0
+#define INTR_WINDOW_EXIT_NO	7
+#define NMI_WINDOW_EXIT_NO	8
+#define CPUID_EXIT_NO		10
+#define HLT_EXIT_NO		12
+#define VMCALL_EXIT_NO		18
+#define MOV_CR_EXIT_NO		28
+#define INVLPG_EXIT_NO		14
+#define IO_EXIT_NO		30
+#define RDMSR_EXIT_NO		31
+#define EPT_VIOLATION_EXIT_NO	48
+#define EPT_MISCONFIG_EXIT_NO	49
+#define INVPCID_EXIT_NO		58
+#define PML_FULL_EXIT_NO	62
+
 static __used void error_handler(void)
 {
 	panic("VMRESUME failed...");
 }
 
+/* CPUID leaves served by the fast path (the subleaf is ignored) */
+struct cpuid_leaf {
+	u32	leaf;
+	u32	eax;
+	u32	ebx;
+	u32	ecx;
+	u32	edx;
+} __packed;
+
+/* MSRs read through the fast path, their reads exit (see the MSR bitmap) */
+struct fast_msr {
+	u32	index;
+	u32	pad;
+	u64	value;
+} __packed;
+
+/* cpuid[1].edx */
+#define NEED_FPU	(1 << 0)
+#define NEED_VME	(1 << 1)
+#define NEED_DE		(1 << 2)
+#define NEED_PSE	(1 << 3)
+#define NEED_TSC	(1 << 4)
+#define NEED_MSR	(1 << 5)
+#define NEED_PAE	(1 << 6)
+#define NEED_MCE	(1 << 7)
+#define NEED_CX8	(1 << 8)
+#define NEED_APIC	(1 << 9)
+#define NEED_SEP	(1 << 11)
+#define NEED_PGE	(1 << 13)
+#define NEED_MCA	(1 << 14)
+#define NEED_CMOV	(1 << 15)
+#define NEED_PAT	(1 << 16)
+#define NEED_PSE36	(1 << 17)
+#define NEED_PSN	(1 << 18)
+#define NEED_CLFSH	(1 << 19)
+#define NEED_DS		(1 << 21)
+#define NEED_ACPI	(1 << 22)
+#define NEED_MMX	(1 << 23)
+#define NEED_FXSR	(1 << 24)
+#define NEED_SSE	(1 << 25)
+#define NEED_SSE2	(1 << 26)
+#define NEED_XMM	NEED_SSE
+#define NEED_XMM2	NEED_SSE2
+#define NEED_SS		(1 << 27)
+#define NEED_HTT	(1 << 28)
+#define NEED_TM		(1 << 29)
+#define NEED_PBE	(1u << 31)
+
+#define NEED_LM		(1 << 29)
+#define NEED_3DNOW	(1u << 31)
+
+/* Minimum to make 64bits linux happy */
+#define CPUID_1_EAX	0
+#define CPUID_1_EBX	0
+#define CPUID_1_ECX	0
+#define CPUID_1_EDX	(NEED_FPU|NEED_PSE|NEED_MSR|NEED_PAE|\
+			 NEED_CX8|NEED_PGE|NEED_FXSR|NEED_CMOV|\
+			 NEED_XMM|NEED_XMM2)
+
+/* Four characters of the vendor string "BitzDuLSE!" */
+#define CPUID_SIG(a, b, c, d)	((a) | (b) << 8 | (c) << 16 | (u32)(d) << 24)
+
+static __used const struct cpuid_leaf cpuid_leaves[] = {
+	{ 0, 1, CPUID_SIG('B', 'i', 't', 'z'), CPUID_SIG('E', '!', 0, 0),
+	  CPUID_SIG('D', 'u', 'L', 'S') },
+	{ 1, CPUID_1_EAX, CPUID_1_EBX, CPUID_1_ECX, CPUID_1_EDX },
+	/* Extended CPUIDs */
+	{ 0x80000000, 0x80000001, 0, 0, 0 },
+	{ 0x80000001, 0, 0, 0, NEED_LM|NEED_3DNOW },
+};
+static __used const u32 nr_cpuid_leaves = array_size(cpuid_leaves);
+
+/* VMX is not exposed to the guest */
+static __used const struct fast_msr fast_msrs[] = {
+	{ MSR_FEATURE_CONTROL, 0, MSR_FEATURE_CONTROL_LOCK },
+};
+static __used const u32 nr_fast_msrs = array_size(fast_msrs);
+
+/* Offsets in struct vm_exit_ctx */
+#define CTX_RBP		0x18
+#define CTX_RSI		0x20
+#define CTX_RDI		0x28
+#define CTX_RAX		0x30
+#define CTX_RBX		0x38
+#define CTX_RCX		0x40
+#define CTX_RDX		0x48
+#define CTX_R8		0x50
+#define CTX_R9		0x58
+#define CTX_R10		0x60
+#define CTX_R11		0x68
+#define CTX_R12		0x70
+#define CTX_R13		0x78
+#define CTX_R14		0x80
+#define CTX_R15		0x88
+#define CTX_VMM		0xa0
+
+_Static_assert(offsetof(struct vm_exit_ctx, regs.rbp) == CTX_RBP, "ctx");
+_Static_assert(offsetof(struct vm_exit_ctx, regs.rax) == CTX_RAX, "ctx");
+_Static_assert(offsetof(struct vm_exit_ctx, regs.r15) == CTX_R15, "ctx");
+_Static_assert(offsetof(struct vm_exit_ctx, vmm) == CTX_VMM, "ctx");
+_Static_assert(sizeof(struct cpuid_leaf) == 20, "cpuid_leaf");
+_Static_assert(sizeof(struct fast_msr) == 16, "fast_msr");
+
+/* VMCS field encodings used by the stub */
+#define VMCS_EXIT_REASON	0x4402
+#define VMCS_EXIT_QUAL		0x6400
+#define VMCS_INSN_LEN		0x440c
+#define VMCS_GUEST_RIP		0x681e
+
+_Static_assert(VMCS_EXIT_REASON == VM_EXIT_REASON, "vmcs");
+_Static_assert(VMCS_EXIT_QUAL == EXIT_QUALIFICATION, "vmcs");
+_Static_assert(VMCS_INSN_LEN == VM_EXIT_INSTRUCTION_LEN, "vmcs");
+_Static_assert(VMCS_GUEST_RIP == GUEST_RIP, "vmcs");
+
+/* Byte OUT to the COM1 THR through DX */
+#define SERIAL_THR_OUT_QUAL	(0x3f8 << 16)
+
+#define STR(x)			__stringify(x)
+#define CTX(reg)		STR(CTX_##reg) "(%rsp)"
+#define SAVE_REG(reg, REG)	"movq	%" #reg ", " CTX(REG) "\n\t"
+#define LOAD_REG(reg, REG)	"movq	" CTX(REG) ", %" #reg "\n\t"
+#define COUNT_FAST(exit_no) \
+	"incq	fast_exit_counts + 8 * " STR(exit_no) "(%rip)\n\t"
+
+/*
+ * RSP points to the vCPU struct vm_exit_ctx. The hottest exits only save
+ * RAX, RCX and RDX, are served from tables and resume right away: CPUID,
+ * byte writes to the serial THR (buffered, a newline, a full buffer or
+ * old output takes the slow path which prints it) and reads of trivial
+ * MSRs.
+ * Everything else saves all GPRs and calls vm_exit_dispatch().
+ */
+asm (
+	".pushsection .text\n\t"
+	".global vm_exit_stub\n\t"
+	"vm_exit_stub:\n\t"
+	SAVE_REG(rax, RAX)
+	SAVE_REG(rcx, RCX)
+	SAVE_REG(rdx, RDX)
+	"movq	$" STR(VMCS_EXIT_REASON) ", %rax\n\t"
+	"vmread	%rax, %rcx\n\t"
+	"cmpl	$" STR(CPUID_EXIT_NO) ", %ecx\n\t"
+	"je	fast_cpuid\n\t"
+	"cmpl	$" STR(IO_EXIT_NO) ", %ecx\n\t"
+	"je	fast_io\n\t"
+	"cmpl	$" STR(RDMSR_EXIT_NO) ", %ecx\n\t"
+	"je	fast_rdmsr\n\t"
+	"jmp	slow_exit\n"
+
+	"fast_cpuid:\n\t"
+	"movl	" CTX(RAX) ", %eax\n\t"
+	"leaq	cpuid_leaves(%rip), %rdx\n\t"
+	"movl	nr_cpuid_leaves(%rip), %ecx\n"
+	"1:\n\t"
+	"testl	%ecx, %ecx\n\t"
+	"jz	slow_exit\n\t"
+	"cmpl	(%rdx), %eax\n\t"
+	"je	2f\n\t"
+	"addq	$20, %rdx\n\t"
+	"decl	%ecx\n\t"
+	"jmp	1b\n"
+	"2:\n\t"
+	"movl	4(%rdx), %eax\n\t"
+	SAVE_REG(rax, RAX)
+	"movl	12(%rdx), %eax\n\t"
+	SAVE_REG(rax, RCX)
+	"movl	8(%rdx), %ebx\n\t"
+	"movl	16(%rdx), %edx\n\t"
+	SAVE_REG(rdx, RDX)
+	COUNT_FAST(CPUID_EXIT_NO)
+	"jmp	fast_exit_resume\n"
+
+	"fast_io:\n\t"
+	"movq	$" STR(VMCS_EXIT_QUAL) ", %rax\n\t"
+	"vmread	%rax, %rcx\n\t"
+	"cmpq	$" STR(SERIAL_THR_OUT_QUAL) ", %rcx\n\t"
+	"jne	slow_exit\n\t"
+	"cmpb	$0, uart_tx_direct(%rip)\n\t"
+	"je	slow_exit\n\t"
+	"movl	uart_tx_len(%rip), %ecx\n\t"
+	"cmpl	$" STR(UART_TX_BUF_SIZE) ", %ecx\n\t"
+	"jae	slow_exit\n\t"
+	"rdtsc\n\t"
+	"shlq	$32, %rdx\n\t"
+	"orq	%rdx, %rax\n\t"
+	"testl	%ecx, %ecx\n\t"
+	"jnz	1f\n\t"
+	"movq	%rax, uart_tx_tsc(%rip)\n"
+	"1:\n\t"
+	"subq	uart_tx_tsc(%rip), %rax\n\t"
+	"cmpq	$" STR(UART_TX_MAX_CYCLES) ", %rax\n\t"
+	"jae	slow_exit\n\t"
+	"movzbl	" CTX(RAX) ", %eax\n\t"
+	"cmpb	$0x0a, %al\n\t"	/* '\n' */
+	"je	slow_exit\n\t"
+	"leaq	uart_tx_buf(%rip), %rdx\n\t"
+	"movb	%al, (%rdx, %rcx)\n\t"
+	"incl	%ecx\n\t"
+	"movl	%ecx, uart_tx_len(%rip)\n\t"
+	COUNT_FAST(IO_EXIT_NO)
+	"jmp	fast_exit_resume\n"
+
+	"fast_rdmsr:\n\t"
+	"movl	" CTX(RCX) ", %eax\n\t"
+	"leaq	fast_msrs(%rip), %rdx\n\t"
+	"movl	nr_fast_msrs(%rip), %ecx\n"
+	"1:\n\t"
+	"testl	%ecx, %ecx\n\t"
+	"jz	slow_exit\n\t"
+	"cmpl	(%rdx), %eax\n\t"
+	"je	2f\n\t"
+	"addq	$16, %rdx\n\t"
+	"decl	%ecx\n\t"
+	"jmp	1b\n"
+	"2:\n\t"
+	"movl	8(%rdx), %eax\n\t"
+	SAVE_REG(rax, RAX)
+	"movl	12(%rdx), %eax\n\t"
+	SAVE_REG(rax, RDX)
+	COUNT_FAST(RDMSR_EXIT_NO)
+
+	/* Skip the instruction */
+	"fast_exit_resume:\n\t"
+	"movq	$" STR(VMCS_GUEST_RIP) ", %rdx\n\t"
+	"vmread	%rdx, %rax\n\t"
+	"movq	$" STR(VMCS_INSN_LEN) ", %rcx\n\t"
+	"vmread	%rcx, %rcx\n\t"
+	"addq	%rcx, %rax\n\t"
+	"vmwrite	%rax, %rdx\n\t"
+	LOAD_REG(rax, RAX)
+	LOAD_REG(rcx, RCX)
+	LOAD_REG(rdx, RDX)
+	"vmresume\n\t"
+	"jmp	error_handler\n"
+
+	"slow_exit:\n\t"
+	SAVE_REG(rbx, RBX)
+	SAVE_REG(rbp, RBP)
+	SAVE_REG(rsi, RSI)
+	SAVE_REG(rdi, RDI)
+	SAVE_REG(r8, R8)
+	SAVE_REG(r9, R9)
+	SAVE_REG(r10, R10)
+	SAVE_REG(r11, R11)
+	SAVE_REG(r12, R12)
+	SAVE_REG(r13, R13)
+	SAVE_REG(r14, R14)
+	SAVE_REG(r15, R15)
+	"movq	" CTX(VMM) ", %rdi\n\t"
+	"movq	%rsp, %rsi\n\t"
+	"callq	vm_exit_dispatch\n\t"
+	LOAD_REG(rax, RAX)
+	LOAD_REG(rbx, RBX)
+	LOAD_REG(rcx, RCX)
+	LOAD_REG(rdx, RDX)
+	LOAD_REG(rbp, RBP)
+	LOAD_REG(rsi, RSI)
+	LOAD_REG(rdi, RDI)
+	LOAD_REG(r8, R8)
+	LOAD_REG(r9, R9)
+	LOAD_REG(r10, R10)
+	LOAD_REG(r11, R11)
+	LOAD_REG(r12, R12)
+	LOAD_REG(r13, R13)
+	LOAD_REG(r14, R14)
+	LOAD_REG(r15, R15)
+	"vmresume\n\t"
+	"jmp	error_handler\n\t"
+	".popsection\n\t"
+);
+
 #ifdef DEBUG
 static const char *vm_exit_reason_str[] = {
 	[0] = "Exception or NMI",
@@ -116,8 +374,15 @@ static const char *vm_exit_reason_str[] = {
 };
 #endif
 
-static void dump_vm_exit_ctx(struct vm_exit_ctx *ctx)
+static void dump_vm_exit_ctx(struct vmm *vmm, struct vm_exit_ctx *ctx)
 {
+	/* The guest output leading to this first */
+	uart_8250_flush();
+
+	ctx->regs.rip = vmcs_cache_read(vmm, VCACHE_RIP);
+	ctx->regs.rsp = vmcs_cache_read(vmm, VCACHE_RSP);
+	ctx->regs.rflags = vmcs_cache_read(vmm, VCACHE_RFLAGS);
+
 	printf("Guest registers:\n");
 	dump_x86_regs(&ctx->regs);
 
@@ -128,7 +393,7 @@ static void dump_vm_exit_ctx(struct vm_exit_ctx *ctx)
 static void default_vm_exit_handler(struct vmm *vmm __maybe_unused,
 				    struct vm_exit_ctx *ctx)
 {
-	dump_vm_exit_ctx(ctx);
+	dump_vm_exit_ctx(vmm, ctx);
 	panic("");
 }
 
@@ -145,9 +410,8 @@ static int add_vm_exit_handler(const u32 n, vm_exit_handler_t handler)
 	return 0;
 }
 
-/* Dummy handler that just pretty prints the error code */
-static void ept_violation_handler(struct vmm *vmm __maybe_unused,
-				  struct vm_exit_ctx *ctx)
+/* Pretty prints the error code */
+static void dump_ept_violation(struct vmm *vmm, struct vm_exit_ctx *ctx)
 {
 	u64 qual = ctx->exit_qual;
 	printf("EPT Error code: ");
@@ -172,7 +436,7 @@ static void ept_violation_handler(struct vmm *vmm __maybe_unused,
 #undef X
 
 	printf("\n");
-	dump_vm_exit_ctx(ctx);
+	dump_vm_exit_ctx(vmm, ctx);
 
 	printf("Guest linear addr: %#lx\n", guest_addr);
 	__vmread(GUEST_PHYSICAL_ADDRESS, &guest_addr);
@@ -182,6 +446,33 @@ static void ept_violation_handler(struct vmm *vmm __maybe_unused,
 	panic("");
 }
 
+#define EPT_VIOLATION_WRITE	(1 << 1)
+
+/*
+ * Guest RAM is backed on first access and writes to pages write protected
+ * for dirty logging are logged, anything else (holes, writes to ROM) is
+ * fatal.
+ */
+static void ept_violation_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
+{
+	gpa_t gpa;
+	__vmread(GUEST_PHYSICAL_ADDRESS, &gpa);
+
+	const struct memslot *slot = memslot_find(&vmm->memslots, gpa);
+	if (slot == NULL || slot->backing)
+		dump_ept_violation(vmm, ctx);
+
+	if (ept_translate(vmm, gpa) != (hpa_t)-1) {
+		if ((ctx->exit_qual & EPT_VIOLATION_WRITE)
+		    && !ept_log_dirty_write(vmm, gpa))
+			return;
+		dump_ept_violation(vmm, ctx);
+	}
+
+	if (ept_populate(vmm, gpa))
+		panic("Out of memory for guest RAM at %#llx\n", gpa);
+}
+
 
 static inline void set_ctx_cpuid(struct vm_exit_ctx *ctx, u64 eax, u64 ebx,
 				 u64 ecx, u64 edx)
@@ -192,74 +483,64 @@ static inline void set_ctx_cpuid(struct vm_exit_ctx *ctx, u64 eax, u64 ebx,
 	ctx->regs.rdx = edx;
 }
 
-/* cpuid[1].edx */
-#define NEED_FPU	(1 << 0)
-#define NEED_VME	(1 << 1)
-#define NEED_DE		(1 << 2)
-#define NEED_PSE	(1 << 3)
-#define NEED_TSC	(1 << 4)
-#define NEED_MSR	(1 << 5)
-#define NEED_PAE	(1 << 6)
-#define NEED_MCE	(1 << 7)
-#define NEED_CX8	(1 << 8)
-#define NEED_APIC	(1 << 9)
-#define NEED_SEP	(1 << 11)
-#define NEED_PGE	(1 << 13)
-#define NEED_MCA	(1 << 14)
-#define NEED_CMOV	(1 << 15)
-#define NEED_PAT	(1 << 16)
-#define NEED_PSE36	(1 << 17)
-#define NEED_PSN	(1 << 18)
-#define NEED_CLFSH	(1 << 19)
-#define NEED_DS		(1 << 21)
-#define NEED_ACPI	(1 << 22)
-#define NEED_MMX	(1 << 23)
-#define NEED_FXSR	(1 << 24)
-#define NEED_SSE	(1 << 25)
-#define NEED_SSE2	(1 << 26)
-#define NEED_XMM	NEED_SSE
-#define NEED_XMM2	NEED_SSE2
-#define NEED_SS		(1 << 27)
-#define NEED_HTT	(1 << 28)
-#define NEED_TM		(1 << 29)
-#define NEED_PBE	(1 << 31)
+/* Leaves missed by the fast path */
+static void cpuid_exit_handler(struct vmm *vmm __unused, struct vm_exit_ctx *ctx)
+{
+	for (u32 i = 0; i < nr_cpuid_leaves; ++i) {
+		const struct cpuid_leaf *l = &cpuid_leaves[i];
+		if (l->leaf == (u32)ctx->regs.rax) {
+			set_ctx_cpuid(ctx, l->eax, l->ebx, l->ecx, l->edx);
+			return;
+		}
+	}
+	panic("CPUID eax not implemented yet\n");
+}
 
-#define NEED_LM		(1 << 29)
-#define NEED_3DNOW	(1 << 31)
+/* DPL of SS is the CPL */
+static inline u8 guest_cpl(struct vmm *vmm)
+{
+	return (vmcs_cache_read(vmm, VCACHE_SS_AR) >> 5) & 3;
+}
 
-/* Minimum to make 64bits linux happy */
-#define CPUID_1_EAX	0
-#define CPUID_1_EBX	0
-#define CPUID_1_ECX	0
-#define CPUID_1_EDX	(NEED_FPU|NEED_PSE|NEED_MSR|NEED_PAE|\
-			 NEED_CX8|NEED_PGE|NEED_FXSR|NEED_CMOV|\
-			 NEED_XMM|NEED_XMM2)
+#ifdef EPT_4K_ONLY
+#define EPT_LEAVES_STR	"4K"
+#else
+#define EPT_LEAVES_STR	"huge"
+#endif
 
-static void cpuid_exit_handler(struct vmm *vmm __unused, struct vm_exit_ctx *ctx)
+static void vmcall_exit_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
 {
-	const char signature[] = "BitzDuLSE!\0\0";
-	const u32 *sig_ptr = (const u32 *)signature;
-	u64 sig1 = (u64)sig_ptr[0];
-	u64 sig2 = (u64)sig_ptr[2];
-	u64 sig3 = (u64)sig_ptr[1];
+	if (guest_cpl(vmm) != 0) {
+		ctx->regs.rax = HC_EPERM;
+		return;
+	}
 
 	switch (ctx->regs.rax) {
-	case 0:
-		set_ctx_cpuid(ctx, 1, sig1, sig2, sig3);
+	case HC_DUMP_MEM_STATS:
+		dump_mem_stats();
+		ctx->regs.rax = HC_SUCCESS;
 		break;
-	case 1:
-		set_ctx_cpuid(ctx, CPUID_1_EAX, CPUID_1_EBX, CPUID_1_ECX,
-			      CPUID_1_EDX);
+	case HC_DUMP_EXIT_STATS:
+		dump_exit_stats();
+		ctx->regs.rax = HC_SUCCESS;
 		break;
-	/* Extended CPUIDs */
-	case 0x80000000:
-		set_ctx_cpuid(ctx, 0x80000001, 0, 0, 0);
+	case HC_RESET_EXIT_STATS:
+		reset_exit_stats();
+		ctx->regs.rax = HC_SUCCESS;
 		break;
-	case 0x80000001:
-		set_ctx_cpuid(ctx, 0, 0, 0, NEED_LM|NEED_3DNOW);
+	case HC_STRIDE_BENCH:
+		/* Issued from 32 bit code */
+		printf("Stride bench, %s EPT pages: %llu cycles per page read\n",
+		       EPT_LEAVES_STR, ctx->regs.rbx & 0xffffffff);
+		ctx->regs.rax = HC_SUCCESS;
+		break;
+	case HC_DUMP_TLB_STATS:
+		printf("Guest TLB: %llu hits, %llu misses, %llu flushes\n",
+		       vmm->tlb.hits, vmm->tlb.misses, vmm->tlb.flushes);
+		ctx->regs.rax = HC_SUCCESS;
 		break;
 	default:
-		panic("CPUID eax not implemented yet\n");
+		ctx->regs.rax = HC_ENOSYS;
 		break;
 	}
 }
@@ -284,29 +565,207 @@ struct idt_vector_info {
 	};
 } __packed;
 
+static void read_guest_state(struct vmm *vmm);
+
+/* Vector, type, error code and valid bits, the format of both fields */
+#define INTR_INFO_INJECT_MASK	0x80000fffu
+#define EXCEPTION_VEC_DB	1
+#define EXCEPTION_VEC_NMI	2
+#define EXCEPTION_VEC_DF	8
+#define EXCEPTION_VEC_PF	14
+
+/*
+ * Events that cannot be injected right away wait for the guest to be able
+ * to take them: interrupt-window exits for external interrupts, NMI-window
+ * exits for NMIs (interrupt windows without virtual NMIs). Interrupts are
+ * kept per vector and injected highest first, like the local APIC does,
+ * only one NMI is kept pending, like the CPU does.
+ */
+static void queue_external_interrupt(struct vmm *vmm, u8 vec)
+{
+	vmm->pending_irqs[vec / 64] |= 1ull << (vec % 64);
+	vmx_interrupt_window_exits(vmm, 1);
+}
+
+static void queue_nmi(struct vmm *vmm)
+{
+	vmm->pending_nmi = 1;
+	if (vmm->virtual_nmis)
+		vmx_nmi_window_exits(vmm, 1);
+	else
+		vmx_interrupt_window_exits(vmm, 1);
+}
+
+/* #DE, #TS, #NP, #SS and #GP */
+static inline int exception_contributory(u8 vec)
+{
+	return vec == 0 || (vec >= 10 && vec <= 13);
+}
+
+/*
+ * The exception `info` hit while the CPU delivered another event (SDM
+ * Vol. 3 6.15). Two contributory exceptions, or a page fault then either
+ * kind, make a double fault. One of those while delivering a double fault
+ * is a triple fault. Otherwise the exception goes first: a faulting
+ * instruction runs again after it and raises its event again, but an
+ * external interrupt or NMI would be lost, it is queued.
+ */
+static void merge_vectoring_event(struct vmm *vmm,
+				  struct idt_vector_info *info)
+{
+	u64 val;
+	__vmread(IDT_VECTORING_INFO, &val);
+	const struct idt_vector_info first = {
+		.dword = val & INTR_INFO_INJECT_MASK,
+	};
+	if (!first.valid)
+		return;
+
+	const int faults = info->type == INTR_HW_EXCEPTION
+			   && (info->vec == EXCEPTION_VEC_PF
+			       || exception_contributory(info->vec));
+	if (first.type == INTR_HW_EXCEPTION && faults) {
+		if (first.vec == EXCEPTION_VEC_DF)
+			panic("Guest triple fault on %s\n",
+			      exception_str(info->vec));
+		if (first.vec == EXCEPTION_VEC_PF
+		    || (exception_contributory(first.vec)
+			&& exception_contributory(info->vec))) {
+			info->vec = EXCEPTION_VEC_DF;
+			info->code_valid = 1;
+			__vmwrite(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+			return;
+		}
+	}
+
+	if (first.type == INTR_EXTERNAL)
+		queue_external_interrupt(vmm, first.vec);
+	else if (first.type == INTR_NMI)
+		queue_nmi(vmm);
+}
+
+/*
+ * An exit during event delivery cancels the event: the instruction runs
+ * again after EPT violations and the like, queue the event again.
+ */
+static void reinject_vectoring_event(void)
+{
+	u64 val;
+	__vmread(IDT_VECTORING_INFO, &val);
+	const struct idt_vector_info info = {
+		.dword = val & INTR_INFO_INJECT_MASK,
+	};
+	if (!info.valid)
+		return;
+
+	if (info.code_valid) {
+		__vmread(IDT_VECTORING_ERROR_CODE, &val);
+		__vmwrite(VM_ENTRY_EXCEPTION_ERROR_CODE, val);
+	}
+	if (info.type == INTR_SOFT || info.type == INTR_PRIV_EXCEPTION
+	    || info.type == INTR_SOFT_EXCEPTION) {
+		__vmread(VM_EXIT_INSTRUCTION_LEN, &val);
+		__vmwrite(VM_ENTRY_INSTRUCTION_LEN, val);
+	}
+	__vmwrite(VM_ENTRY_INTR_INFO, info.dword);
+}
+
+/*
+ * Intercepted guest exceptions (see vmx_intercept_exception()) are counted
+ * then reflected to the guest through VM entry event injection. Host NMIs
+ * are passed on to the guest.
+ */
 static void exception_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
 {
 	u64 val;
 	__vmread(VM_EXIT_INTR_INFO, &val);
 
 	struct idt_vector_info info_vec = {
-		.dword = val & 0xffffffff,
+		.dword = val & INTR_INFO_INJECT_MASK,
 	};
-	printf("Exception: %s (valid=%u)\n", exception_str(info_vec.vec),
-					     info_vec.valid);
+	if (info_vec.valid && info_vec.type == INTR_NMI) {
+		queue_nmi(vmm);
+		reinject_vectoring_event();
+		return;
+	}
+	if (!info_vec.valid || (info_vec.type != INTR_HW_EXCEPTION
+				&& info_vec.type != INTR_SOFT_EXCEPTION)) {
+		printf("Exception: %s (valid=%u)\n",
+		       exception_str(info_vec.vec), info_vec.valid);
+		dump_vm_exit_ctx(vmm, ctx);
+		read_guest_state(vmm);
+		dump_guest_state(&vmm->guest_state);
+		panic("");
+	}
+	exit_stats_account_exception(info_vec.vec);
 
 	if (info_vec.code_valid) {
 		__vmread(VM_EXIT_INTR_ERROR_CODE, &val);
-		printf("Error code: %#llxx\n", val);
+		__vmwrite(VM_ENTRY_EXCEPTION_ERROR_CODE, val);
+	}
+	/* INT3 and INTO are delivered past the instruction */
+	if (info_vec.type == INTR_SOFT_EXCEPTION) {
+		__vmread(VM_EXIT_INSTRUCTION_LEN, &val);
+		__vmwrite(VM_ENTRY_INSTRUCTION_LEN, val);
 	}
 
-	dump_vm_exit_ctx(ctx);
-	dump_guest_state(&vmm->guest_state);
+	/*
+	 * The exit happens before CR2 and DR6 are updated, and neither is
+	 * switched on VM entry: load what the guest handler expects.
+	 */
+	if (info_vec.vec == EXCEPTION_VEC_PF)
+		write_cr2(ctx->exit_qual);
+	else if (info_vec.vec == EXCEPTION_VEC_DB)
+		write_dr6(read_dr6() | ctx->exit_qual);
+
+	merge_vectoring_event(vmm, &info_vec);
+	__vmwrite(VM_ENTRY_INTR_INFO, info_vec.dword);
+}
 
-	u64 cr2 = read_cr2();
-	printf("CR2: %#llx\n", cr2);
+static inline void inject_event(u8 vec, u8 type)
+{
+	const struct idt_vector_info info = {
+		.vec = vec,
+		.type = type,
+		.valid = 1,
+	};
+	__vmwrite(VM_ENTRY_INTR_INFO, info.dword);
+}
 
-	panic("");
+/* The guest can take an interrupt, one of the queued ones goes in */
+static void intr_window_exit_handler(struct vmm *vmm,
+				     struct vm_exit_ctx *ctx __unused)
+{
+	int pending = 0;
+	if (vmm->pending_nmi && !vmm->virtual_nmis) {
+		inject_event(EXCEPTION_VEC_NMI, INTR_NMI);
+		vmm->pending_nmi = 0;
+	} else {
+		for (int i = array_size(vmm->pending_irqs) - 1; i >= 0; --i) {
+			const u64 irqs = vmm->pending_irqs[i];
+			if (!irqs)
+				continue;
+			const u8 bit = 63 - __builtin_clzll(irqs);
+			inject_event(i * 64 + bit, INTR_EXTERNAL);
+			vmm->pending_irqs[i] &= ~(1ull << bit);
+			break;
+		}
+	}
+
+	for (u32 i = 0; i < array_size(vmm->pending_irqs); ++i)
+		pending |= !!vmm->pending_irqs[i];
+	pending |= vmm->pending_nmi && !vmm->virtual_nmis;
+	if (!pending)
+		vmx_interrupt_window_exits(vmm, 0);
+}
+
+/* Virtual NMIs are unblocked: the queued NMI goes in */
+static void nmi_window_exit_handler(struct vmm *vmm,
+				    struct vm_exit_ctx *ctx __unused)
+{
+	inject_event(EXCEPTION_VEC_NMI, INTR_NMI);
+	vmm->pending_nmi = 0;
+	vmx_nmi_window_exits(vmm, 0);
 }
 
 #define ACCESS_TYPE_MOV_TO_CR	0
@@ -329,7 +788,8 @@ struct cr_access_info {
 	};
 } __packed;
 
-static u64 *get_operand_reg(struct vm_exit_ctx *ctx, u8 num)
+/* RSP is not saved on exit, writes to it go through the VMCS cache */
+static u64 *get_operand_reg(struct vmm *vmm, struct vm_exit_ctx *ctx, u8 num)
 {
 	switch (num) {
 	case 0:
@@ -341,6 +801,7 @@ static u64 *get_operand_reg(struct vm_exit_ctx *ctx, u8 num)
 	case 3:
 		return &ctx->regs.rbx;
 	case 4:
+		ctx->regs.rsp = vmcs_cache_read(vmm, VCACHE_RSP);
 		return &ctx->regs.rsp;
 	case 5:
 		return &ctx->regs.rbp;
@@ -355,29 +816,32 @@ static u64 *get_operand_reg(struct vm_exit_ctx *ctx, u8 num)
 	}
 }
 
+/* PAE: CR3 points to the 32 byte aligned table of the 4 PDPTEs */
+#define PAE_PDPT_MASK	0xffffffe0ULL
+
 static void reload_pdpte(struct vmm *vmm)
 {
-	u64 cr3 = vmm->guest_state.reg_state.control_regs.cr3 & PAGE_MASK;
-	u64 *pdpte = (u64 *)gpa_to_hva(vmm, cr3);
+	u64 cr3 = vmcs_cache_read(vmm, VCACHE_CR3) & PAE_PDPT_MASK;
+	u64 pdpte[4];
+	if (copy_from_guest_phys(vmm, pdpte, cr3, sizeof(pdpte)))
+		panic("PDPTEs at %#llx are not in guest RAM\n", cr3);
 
-	for (u8 i = 0; i < 4; ++i) {
-		vmm->guest_state.pdpte[i] = pdpte[i];
-		__vmwrite(GUEST_PDPTE0 + i * 2, pdpte[i]);
-	}
+	for (u8 i = 0; i < 4; ++i)
+		vmcs_cache_write(vmm, VCACHE_PDPTE0 + i, pdpte[i]);
 }
 
-/* TODO REMOVE MOV TO CR3 LOAD EXIT VM ENTRY CONTROL */
 static void set_guest_long_mode(struct vmm *vmm)
 {
-	struct vmcs_guest_register_state *state = &vmm->guest_state.reg_state;
-	state->msr.ia32_efer |= MSR_EFER_LMA;
-
-	__vmwrite(GUEST_EFER, state->msr.ia32_efer);
+	vmcs_cache_write(vmm, VCACHE_EFER,
+			 vmcs_cache_read(vmm, VCACHE_EFER) | MSR_EFER_LMA);
 
 	u64 vm_entry_ctl;
 	__vmread(VM_ENTRY_CONTROLS, &vm_entry_ctl);
 	vm_entry_ctl |= VM_ENTRY_IA32E_GUEST;
 	__vmwrite(VM_ENTRY_CONTROLS, vm_entry_ctl);
+
+	vmx_drop_cr3_load_exits(vmm);
+	exit_stats_cr3_load_exits_dropped();
 }
 
 static inline int turn_on_paging(u64 *new_cr0, u64 *cr0)
@@ -385,41 +849,47 @@ static inline int turn_on_paging(u64 *new_cr0, u64 *cr0)
 	return !(*cr0 & CR0_PG) && (*new_cr0 & CR0_PG);
 }
 
+/* Software TLB and the VPID tagged hardware entries */
+static void flush_guest_tlb(struct vmm *vmm)
+{
+	guest_tlb_flush(&vmm->tlb);
+	vmx_flush_guest_tlb(vmm);
+}
+
 static inline void cr_access_cr0(struct vmm *vmm, u64 *new_cr0)
 {
-	struct vmcs_guest_register_state *state = &vmm->guest_state.reg_state;
-	u64 *cr0 = &state->control_regs.cr0;
+	u64 cr0 = vmcs_cache_read(vmm, VCACHE_CR0);
+	const u64 efer = vmcs_cache_read(vmm, VCACHE_EFER);
 
-	if (turn_on_paging(new_cr0, cr0) && state->msr.ia32_efer & MSR_EFER_LME)
+	if (turn_on_paging(new_cr0, &cr0) && efer & MSR_EFER_LME)
 		set_guest_long_mode(vmm);
 
-	*cr0 |= *new_cr0;
+	/* Paging mode or write protection may change */
+	flush_guest_tlb(vmm);
 
-	__vmwrite(GUEST_CR0, *cr0);
-	__vmwrite(CR0_READ_SHADOW, *cr0);
+	vmcs_cache_write(vmm, VCACHE_CR0, vmx_guest_cr0(vmm, *new_cr0));
+	__vmwrite(CR0_READ_SHADOW, *new_cr0);
 }
 
 static void cr_access_cr3(struct vmm *vmm, u64 *reg)
 {
-	struct vmcs_guest_register_state *state = &vmm->guest_state.reg_state;
-	u64 *cr3 = &state->control_regs.cr3;
-	*cr3 = *reg;
+	/* The new CR3 is what the PDPTEs and the TLB lookups use */
+	vmcs_cache_write(vmm, VCACHE_CR3, *reg);
+	flush_guest_tlb(vmm);
 
-	u64 long_mode_active = (state->msr.ia32_efer >> MSR_EFER_LMA_BIT) & 1;
+	const u64 efer = vmcs_cache_read(vmm, VCACHE_EFER);
+	u64 long_mode_active = (efer >> MSR_EFER_LMA_BIT) & 1;
 
-	if ((state->control_regs.cr4 & CR4_PAE) && !long_mode_active)
+	if ((vmcs_cache_read(vmm, VCACHE_CR4) & CR4_PAE) && !long_mode_active)
 		reload_pdpte(vmm);
-
-	__vmwrite(GUEST_CR3, *cr3);
 }
 
 static void cr_access_cr4(struct vmm *vmm, u64 *reg)
 {
-	u64 *cr4 = &vmm->guest_state.reg_state.control_regs.cr4;
-	*cr4 |= *reg;
+	flush_guest_tlb(vmm);
 
-	__vmwrite(GUEST_CR4, *cr4);
-	__vmwrite(CR4_READ_SHADOW, *cr4);
+	vmcs_cache_write(vmm, VCACHE_CR4, vmx_guest_cr4(vmm, *reg));
+	__vmwrite(CR4_READ_SHADOW, *reg);
 }
 
 static void cr_access_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
@@ -431,7 +901,8 @@ static void cr_access_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
 	if (cr_info.access_type != 0)
 		panic("Unimplemented MOV CR access type\n");
 
-	u64 *reg = get_operand_reg(ctx, cr_info.source_op);
+	exit_stats_account_cr(cr_info.num);
+	u64 *reg = get_operand_reg(vmm, ctx, cr_info.source_op);
 
 	if (cr_info.num == 0) {
 		cr_access_cr0(vmm, reg);
@@ -444,6 +915,156 @@ static void cr_access_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
 	}
 }
 
+/*
+ * The guest translations are tagged with its VPID, if any. INVLPG only
+ * exits until the guest is in long mode, see vmx_drop_cr3_load_exits().
+ */
+static void invlpg_exit_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
+{
+	exit_stats_account_invlpg();
+	guest_tlb_flush_page(&vmm->tlb, ctx->exit_qual);
+	vmx_flush_guest_page(vmm, ctx->exit_qual);
+}
+
+static void invpcid_exit_handler(struct vmm *vmm,
+				 struct vm_exit_ctx *ctx __unused)
+{
+	flush_guest_tlb(vmm);
+}
+
+static void pml_full_exit_handler(struct vmm *vmm,
+				  struct vm_exit_ctx *ctx __unused)
+{
+	vmx_flush_pml(vmm);
+}
+
+#define GUEST_ACTIVITY_HLT	1
+#define GUEST_INTR_BLOCKING_STI	(1 << 0)
+#define GUEST_INTR_BLOCKING_SS	(1 << 1)
+#define GUEST_INTR_BLOCKING_NMI	(1 << 3)
+#define HLT_REFILL_BUDGET	(16 * PAGE_SIZE)
+
+/*
+ * The guest is idle: refill the zeroed page pools, then resume it halted.
+ * Interrupts do not exit, they wake it up directly. Without the HLT
+ * activity state, it resumes past the HLT as if woken up, its idle loop
+ * halts again.
+ */
+static void hlt_exit_handler(struct vmm *vmm,
+			     struct vm_exit_ctx *ctx __unused)
+{
+	refill_zeroed_pages(HLT_REFILL_BUDGET);
+
+	/* The STI shadow only covered the HLT */
+	u64 intr;
+	__vmread(GUEST_INTERRUPTIBILITY_INFO, &intr);
+	intr &= ~(GUEST_INTR_BLOCKING_STI|GUEST_INTR_BLOCKING_SS);
+	__vmwrite(GUEST_INTERRUPTIBILITY_INFO, intr);
+	if (vmm->hlt_activity)
+		__vmwrite(GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_HLT);
+}
+
+/* Segment access rights */
+#define SEG_AR_L	(1 << 13)	/* 64 bit code */
+#define SEG_AR_DB	(1 << 14)	/* 32 bit default size */
+
+/* Default address size of the guest code, in bytes */
+static u8 guest_insn_mode(struct vmm *vmm)
+{
+	const u64 cs_ar = vmcs_cache_read(vmm, VCACHE_CS_AR);
+	if ((vmcs_cache_read(vmm, VCACHE_EFER) & MSR_EFER_LMA)
+	    && (cs_ar & SEG_AR_L))
+		return 8;
+	return cs_ar & SEG_AR_DB ? 4 : 2;
+}
+
+/* Returns the number of bytes fetched, up to the first unmapped page */
+static u64 fetch_guest_insn(struct vmm *vmm, gva_t rip, u8 *insn)
+{
+	const int paging = vmcs_cache_read(vmm, VCACHE_CR0) & CR0_PG;
+	u64 len = 0;
+
+	while (len < MMIO_INSN_MAX) {
+		const gva_t gva = rip + len;
+		const u64 n = min(PAGE_SIZE - (gva & ~PAGE_MASK),
+				  MMIO_INSN_MAX - len);
+		int err = paging ? copy_from_guest(vmm, insn + len, gva, n)
+				 : copy_from_guest_phys(vmm, insn + len, gva, n);
+		if (err)
+			break;
+		len += n;
+	}
+	return len;
+}
+
+static inline u64 mmio_size_mask(u8 size)
+{
+	return size == 8 ? ~0ULL : (1ULL << (size * 8)) - 1;
+}
+
+/* 32 bit results are zero extended, 8 and 16 bit ones are merged */
+static void set_operand_reg(u64 *reg, u64 val, u8 size, u8 high_byte)
+{
+	const u64 mask = mmio_size_mask(size);
+	if (high_byte)
+		*reg = (*reg & ~0xff00ULL) | (val & 0xff) << 8;
+	else if (size < 4)
+		*reg = (*reg & ~mask) | (val & mask);
+	else
+		*reg = val & mask;
+}
+
+/*
+ * Emulated MMIO regions are mapped with misconfigured EPT entries: the
+ * access is emulated and the instruction skipped.
+ */
+static void ept_misconfig_handler(struct vmm *vmm, struct vm_exit_ctx *ctx)
+{
+	gpa_t gpa;
+	__vmread(GUEST_PHYSICAL_ADDRESS, &gpa);
+
+	const struct mmio_region *region = mmio_region_find(&vmm->mmio, gpa);
+	if (region == NULL) {
+		dump_vm_exit_ctx(vmm, ctx);
+		panic("EPT misconfiguration at %#llx\n", gpa);
+	}
+
+	const u8 mode = guest_insn_mode(vmm);
+	gva_t rip = vmcs_cache_read(vmm, VCACHE_RIP);
+	if (mode != 8)
+		rip = (rip + vmcs_cache_read(vmm, VCACHE_CS_BASE)) & 0xffffffff;
+
+	u8 insn[MMIO_INSN_MAX];
+	struct mmio_insn mi;
+	const u64 len = fetch_guest_insn(vmm, rip, insn);
+	if (mmio_decode(insn, len, mode, &mi)) {
+		dump_vm_exit_ctx(vmm, ctx);
+		panic("Cannot emulate the MMIO access at %#llx\n", gpa);
+	}
+
+	const u64 offset = gpa - region->base;
+	const struct mmio_ops *ops = region->ops;
+	u64 *reg = mi.imm_op ? NULL : get_operand_reg(vmm, ctx, mi.reg);
+
+	if (mi.write) {
+		u64 val = mi.imm_op ? mi.imm : *reg >> (mi.high_byte ? 8 : 0);
+		if (ops->write != NULL)
+			ops->write(region->opaque, offset, mi.size,
+				   val & mmio_size_mask(mi.size));
+	} else {
+		u64 val = ~0ULL;
+		if (ops->read != NULL)
+			val = ops->read(region->opaque, offset, mi.size);
+		set_operand_reg(reg, val & mmio_size_mask(mi.size),
+				mi.reg_size, mi.high_byte);
+		if (reg == &ctx->regs.rsp)
+			vmcs_cache_write(vmm, VCACHE_RSP, ctx->regs.rsp);
+	}
+
+	vmcs_cache_write(vmm, VCACHE_RIP, vmcs_cache_read(vmm, VCACHE_RIP)
+			 + mi.len);
+}
+
 #ifdef DEBUG_IO
 static void log_io_access(struct io_access_info *info)
 {
@@ -501,7 +1122,6 @@ struct ioport_dev_handler {
 #define IOPORT_HANDLER(Begin, End, Handler) \
 { .begin = (Begin), .end = (End), .handler = (Handler), }
 
-extern void emulate_uart_8250(struct x86_regs *, struct io_access_info *);
 static struct ioport_dev_handler io_handlers[] = {
 	IOPORT_HANDLER(0x3f8, 0x3ff, emulate_uart_8250),
 };
@@ -523,6 +1143,7 @@ static void io_access_handler(struct vmm *vmm __unused, struct vm_exit_ctx *ctx)
 	};
 
 	const u16 port = info.port;
+	exit_stats_account_io(port);
 
 	io_handler_t handler = ioport_has_emulator(port);
 	if (handler) {
@@ -610,6 +1231,7 @@ static void read_guest_reg_state(struct vmcs_guest_register_state *state)
 	read_guest_msrs(&state->msr);
 }
 
+/* Whole guest state, for dumps only */
 static void read_guest_state(struct vmm *vmm)
 {
 	struct vmcs_guest_state *guest_state = &vmm->guest_state;
@@ -620,8 +1242,73 @@ static void read_guest_state(struct vmm *vmm)
 	}
 }
 
+/*
+ * The exit happened before the instruction completed and there is no
+ * instruction length: it runs again, unless the handler emulated it.
+ */
+static inline int vm_exit_restarts_insn(u16 exit_reason)
+{
+	return exit_reason == INTR_OR_NMI_EXIT_NO
+	       || exit_reason == INTR_WINDOW_EXIT_NO
+	       || exit_reason == NMI_WINDOW_EXIT_NO
+	       || exit_reason == EPT_VIOLATION_EXIT_NO
+	       || exit_reason == EPT_MISCONFIG_EXIT_NO
+	       || exit_reason == PML_FULL_EXIT_NO;
+}
+
+/* Exit interruption info bit, exit qualification bit of EPT exits */
+#define NMI_UNBLOCKED_BY_IRET	(1 << 12)
+
+/*
+ * With virtual NMIs, an exit in the IRET of a guest NMI handler unblocks
+ * NMIs although the IRET did not complete: block them again.
+ */
+static void restore_nmi_blocking(struct vmm *vmm, struct vm_exit_ctx *ctx)
+{
+	const u16 reason = ctx->exit_code.exit_reason;
+	u64 info = ctx->exit_qual;
+	if (!vmm->virtual_nmis)
+		return;
+	if (reason == INTR_OR_NMI_EXIT_NO)
+		__vmread(VM_EXIT_INTR_INFO, &info);
+	else if (reason != EPT_VIOLATION_EXIT_NO && reason != PML_FULL_EXIT_NO)
+		return;
+	if (!(info & NMI_UNBLOCKED_BY_IRET))
+		return;
+
+	u64 intr;
+	__vmread(GUEST_INTERRUPTIBILITY_INFO, &intr);
+	__vmwrite(GUEST_INTERRUPTIBILITY_INFO, intr | GUEST_INTR_BLOCKING_NMI);
+}
+
+/* Host serial line: 's' dumps the exit statistics, 'r' resets them */
+#define HOST_COM1		0x3f8
+#define HOST_COM1_LSR		(HOST_COM1 + 5)
+#define CONSOLE_POLL_EXITS	4096
+
+static void poll_console(void)
+{
+	static u32 exits;
+	if (++exits % CONSOLE_POLL_EXITS || !(inb(HOST_COM1_LSR) & 1))
+		return;
+
+	switch (inb(HOST_COM1)) {
+	case 's':
+		dump_exit_stats();
+		break;
+	case 'r':
+		reset_exit_stats();
+		break;
+	}
+}
+
 static void __used vm_exit_dispatch(struct vmm *vmm, struct vm_exit_ctx *ctx)
 {
+	const u64 exit_tsc = rdtsc();
+
+	/* Reads since the last flush, by poll_console() say, are stale now */
+	vmm->vmcs_cache.valid = 0;
+
 #ifdef DEBUG
 	printf("\nVM EXIT ");
 #endif
@@ -634,32 +1321,68 @@ static void __used vm_exit_dispatch(struct vmm *vmm, struct vm_exit_ctx *ctx)
 	printf("Reason: %s (%u)\n", vm_exit_reason_str[exit_no], exit_no);
 #endif
 
-	__vmread(GUEST_RIP, &ctx->regs.rip);
-	__vmread(GUEST_RSP, &ctx->regs.rsp);
-	__vmread(GUEST_RFLAGS, &ctx->regs.rflags);
+	/*
+	 * Guest state is read on demand through the VMCS cache, RIP, RSP and
+	 * RFLAGS in ctx->regs are not valid.
+	 * Only handlers of restarting exits may modify guest RIP.
+	 */
+	const u64 handler_tsc = rdtsc();
+	vm_exit_handlers[ctx->exit_code.dword](vmm, ctx);
+	const u64 handler_cycles = rdtsc() - handler_tsc;
 
-	read_guest_state(vmm);
+	if (!vm_exit_restarts_insn(ctx->exit_code.exit_reason)) {
+		u64 insn_len;
+		__vmread(VM_EXIT_INSTRUCTION_LEN, &insn_len);
+		vmcs_cache_write(vmm, VCACHE_RIP,
+				 vmcs_cache_read(vmm, VCACHE_RIP) + insn_len);
+	} else {
+		restore_nmi_blocking(vmm, ctx);
+		/* exception_handler() merges it with the exception */
+		if (ctx->exit_code.exit_reason != INTR_OR_NMI_EXIT_NO)
+			reinject_vectoring_event();
+	}
+	vmcs_cache_flush(vmm);
 
-	/* Handlers must not modify guest RIP */
-	vm_exit_handlers[ctx->exit_code.dword](vmm, ctx);
+	/* Serial output buffered by the fast path */
+	uart_8250_flush();
 
-	u64 insn_len;
-	__vmread(VM_EXIT_INSTRUCTION_LEN, &insn_len);
-	ctx->regs.rip += insn_len;
-	__vmwrite(GUEST_RIP, ctx->regs.rip);
+	exit_stats_account(ctx->exit_code.exit_reason, handler_cycles,
+			   rdtsc() - exit_tsc);
+	poll_console();
 }
 
-#define INTR_OR_NMI_EXIT_NO	0
-#define CPUID_EXIT_NO		10
-#define MOV_CR_EXIT_NO		28
-#define IO_EXIT_NO		30
-#define EPT_VIOLATION_EXIT_NO	48
-int init_vm_exit_handlers(struct vmm *vmm __maybe_unused)
+/* MSRs past the low and high ranges always exit */
+#define MSR_BITMAP_READ_HIGH	1024
+#define MSR_HIGH_BASE		0xc0000000
+#define MSR_RANGE_SIZE		0x2000
+
+static void intercept_msr_read(u8 *bitmap, u32 msr)
+{
+	if (msr >= MSR_HIGH_BASE) {
+		bitmap += MSR_BITMAP_READ_HIGH;
+		msr -= MSR_HIGH_BASE;
+	}
+	if (msr < MSR_RANGE_SIZE)
+		bitmap[msr / 8] |= 1 << (msr % 8);
+}
+
+int init_vm_exit_handlers(struct vmm *vmm)
 {
+	for (u32 i = 0; i < nr_fast_msrs; ++i)
+		intercept_msr_read(vmm->msr_bitmap, fast_msrs[i].index);
+
 	add_vm_exit_handler(INTR_OR_NMI_EXIT_NO, exception_handler);
+	add_vm_exit_handler(INTR_WINDOW_EXIT_NO, intr_window_exit_handler);
+	add_vm_exit_handler(NMI_WINDOW_EXIT_NO, nmi_window_exit_handler);
 	add_vm_exit_handler(CPUID_EXIT_NO, cpuid_exit_handler);
+	add_vm_exit_handler(HLT_EXIT_NO, hlt_exit_handler);
+	add_vm_exit_handler(VMCALL_EXIT_NO, vmcall_exit_handler);
 	add_vm_exit_handler(MOV_CR_EXIT_NO, cr_access_handler);
+	add_vm_exit_handler(INVLPG_EXIT_NO, invlpg_exit_handler);
 	add_vm_exit_handler(IO_EXIT_NO, io_access_handler);
+	add_vm_exit_handler(INVPCID_EXIT_NO, invpcid_exit_handler);
+	add_vm_exit_handler(PML_FULL_EXIT_NO, pml_full_exit_handler);
 	add_vm_exit_handler(EPT_VIOLATION_EXIT_NO, ept_violation_handler);
+	add_vm_exit_handler(EPT_MISCONFIG_EXIT_NO, ept_misconfig_handler);
 	return 0;
 }
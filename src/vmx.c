@@ -5,6 +5,7 @@
 #include <kmalloc.h>
 #include <page.h>
 #include <memory.h>
+#include <spinlock.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -41,27 +42,168 @@ int has_vmx_support(void)
 	return 1;
 }
 
+#define VMM_IDX(idx) 		((idx) - MSR_VMX_BASIC)
+#define VMM_MSR_VMX_BASIC	VMM_IDX(MSR_VMX_BASIC)
+#define VMM_MSR_VMX_CR0_FIXED0	VMM_IDX(MSR_VMX_CR0_FIXED0)
+#define VMM_MSR_VMX_CR0_FIXED1	VMM_IDX(MSR_VMX_CR0_FIXED1)
+#define VMM_MSR_VMX_CR4_FIXED0	VMM_IDX(MSR_VMX_CR4_FIXED0)
+#define VMM_MSR_VMX_CR4_FIXED1	VMM_IDX(MSR_VMX_CR4_FIXED1)
+#define VMM_MSR_VMX_EPT_VPID_CAP VMM_IDX(MSR_VMX_EPT_VPID_CAP)
+#define VMM_MSR_VMX_MISC	VMM_IDX(MSR_VMX_MISC)
+
+#define VMX_MISC_ACTIVITY_HLT	(1ull << 6)
+
 static inline void vmm_read_vmx_msrs(struct vmm *vmm)
 {
 	for (u64 i = 0; i < NR_VMX_MSR; ++i)
 		vmm->vmx_msr[i] = __readmsr(MSR_VMX_BASIC + i);
 }
 
-#define VMCS_NB_PAGES 2
+static struct kmem_cache *vm_exit_stack_cache;
+
+static int vmx_init_caches(void)
+{
+	if (vm_exit_stack_cache == NULL)
+		vm_exit_stack_cache = kmem_cache_create("vm_exit_stack",
+							PAGE_SIZE);
+	return vm_exit_stack_cache == NULL;
+}
+
+#define NR_VPIDS		(1 << 16)
+#define VPID_CAP_INVVPID	(1ull << 32)
+#define VPID_CAP_INVVPID_ADDR	(1ull << 40)
+#define VPID_CAP_INVVPID_SINGLE	(1ull << 41)
+
+/* VPID 0 tags the host translations */
+static u64 vpid_bitmap[NR_VPIDS / 64] = { 1 };
+static spinlock_t vpid_lock = SPINLOCK_INIT;
+
+static int vmx_has_vpid(struct vmm *vmm)
+{
+	const u64 ctls2 = vmm->vmx_msr[VMM_IDX(MSR_VMX_PROC_CTLS2)];
+	const u64 cap = vmm->vmx_msr[VMM_MSR_VMX_EPT_VPID_CAP];
+	return ((ctls2 >> 32) & VM_EXEC_ENABLE_VPID)
+	       && (cap & VPID_CAP_INVVPID) && (cap & VPID_CAP_INVVPID_SINGLE);
+}
+
+/* Returns 0 when the guest has to run untagged */
+static u16 alloc_vpid(struct vmm *vmm)
+{
+	if (!vmx_has_vpid(vmm))
+		return 0;
+
+	u16 vpid = 0;
+	spin_lock(&vpid_lock);
+	for (u64 i = 0; i < NR_VPIDS / 64; ++i) {
+		if (vpid_bitmap[i] == ~0ull)
+			continue;
+		const u64 bit = __builtin_ctzll(~vpid_bitmap[i]);
+		vpid_bitmap[i] |= 1ull << bit;
+		vpid = i * 64 + bit;
+		break;
+	}
+	spin_unlock(&vpid_lock);
+
+	/* A recycled VPID may still tag stale translations */
+	if (vpid)
+		__invvpid(INVVPID_SINGLE_CONTEXT, vpid, 0);
+	return vpid;
+}
+
+static void release_vpid(u16 vpid)
+{
+	if (vpid == 0)
+		return;
+	spin_lock(&vpid_lock);
+	vpid_bitmap[vpid / 64] &= ~(1ull << (vpid % 64));
+	spin_unlock(&vpid_lock);
+}
+
+/* Without a VPID, every VM entry and exit already flushes the guest TLB */
+void vmx_flush_guest_tlb(struct vmm *vmm)
+{
+	if (vmm->vpid)
+		__invvpid(INVVPID_SINGLE_CONTEXT, vmm->vpid, 0);
+}
+
+/* Non canonical addresses make the individual invalidation fail */
+void vmx_flush_guest_page(struct vmm *vmm, gva_t gva)
+{
+	if (!vmm->vpid)
+		return;
+	const u64 cap = vmm->vmx_msr[VMM_MSR_VMX_EPT_VPID_CAP];
+	if (!(cap & VPID_CAP_INVVPID_ADDR)
+	    || __invvpid(INVVPID_INDIVIDUAL_ADDR, vmm->vpid, gva))
+		__invvpid(INVVPID_SINGLE_CONTEXT, vmm->vpid, 0);
+}
+
+void vmx_intercept_exception(u8 vec, int intercept)
+{
+	u64 bitmap;
+	__vmread(EXCEPTION_BITMAP, &bitmap);
+	if (intercept)
+		bitmap |= 1ull << vec;
+	else
+		bitmap &= ~(1ull << vec);
+	__vmwrite(EXCEPTION_BITMAP, bitmap);
+}
+
+/* Zeroed pages allocated for every vCPU (VMXON, VMCS, MSR bitmap) */
+static inline void *alloc_vcpu_page(void)
+{
+	return alloc_zeroed_page();
+}
+
+static inline void release_vcpu_page(void *page)
+{
+	release_page(page);
+}
+
 static int alloc_vmcs(struct vmm *vmm)
 {
-	void *mem = alloc_pages(VMCS_NB_PAGES);
-	if (mem == NULL)
+	vmm->vmx_on = alloc_vcpu_page();
+	if (vmm->vmx_on == NULL)
 		return 1;
-	memset(mem, 0, VMCS_NB_PAGES * PAGE_SIZE);
-	vmm->vmx_on = mem;
-	vmm->vmcs = (vaddr_t)mem + PAGE_SIZE;
+	vmm->vmcs = alloc_vcpu_page();
+	if (vmm->vmcs == NULL) {
+		release_vcpu_page(vmm->vmx_on);
+		return 1;
+	}
 	return 0;
 }
 
 static inline void release_vmcs(struct vmm *vmm)
 {
-	release_pages(vmm->vmx_on, VMCS_NB_PAGES);
+	release_vcpu_page(vmm->vmcs);
+	release_vcpu_page(vmm->vmx_on);
+}
+
+const enum vmcs_field vmcs_cached_fields[NR_VCACHE_FIELDS] = {
+	[VCACHE_RIP] = GUEST_RIP,
+	[VCACHE_RSP] = GUEST_RSP,
+	[VCACHE_RFLAGS] = GUEST_RFLAGS,
+	[VCACHE_CR0] = GUEST_CR0,
+	[VCACHE_CR3] = GUEST_CR3,
+	[VCACHE_CR4] = GUEST_CR4,
+	[VCACHE_EFER] = GUEST_EFER,
+	[VCACHE_CS_BASE] = GUEST_CS_BASE,
+	[VCACHE_CS_AR] = GUEST_CS_AR_BYTES,
+	[VCACHE_SS_AR] = GUEST_SS_AR_BYTES,
+	[VCACHE_PDPTE0] = GUEST_PDPTE0,
+	[VCACHE_PDPTE1] = GUEST_PDPTE0 + 2,
+	[VCACHE_PDPTE2] = GUEST_PDPTE0 + 4,
+	[VCACHE_PDPTE3] = GUEST_PDPTE0 + 6,
+};
+
+void vmcs_cache_flush(struct vmm *vmm)
+{
+	struct vmcs_cache *cache = &vmm->vmcs_cache;
+	for (u32 dirty = cache->dirty; dirty; dirty &= dirty - 1) {
+		const u32 f = __builtin_ctz(dirty);
+		__vmwrite(vmcs_cached_fields[f], cache->val[f]);
+	}
+	cache->valid = 0;
+	cache->dirty = 0;
 }
 
 /* Write back caching */
@@ -91,124 +233,573 @@ static inline void ept_init_default(void *ept_pte, paddr_t paddr)
 	pte->paddr = paddr >> PAGE_SHIFT;
 }
 
-static void ept_init_pt(struct ept_pte *ept_pt, paddr_t host, paddr_t guest)
+static inline void *ept_alloc_table(void)
+{
+	return alloc_zeroed_page();
+}
+
+static inline void *ept_next_table(u64 entry)
+{
+	return (void *)phys_to_virt(entry & PAGE_MASK);
+}
+
+/*
+ * Returns the EPT entry at `index` in the next level table pointed by
+ * `entry`, allocating that table if needed.
+ */
+static void *ept_walk_alloc(void *entry, u16 index)
 {
-	u16 pte_off = pte_offset(guest);
-	for (; pte_off < EPT_PTRS_PER_TABLE; ++pte_off, host += PAGE_SIZE) {
-		struct ept_pte *cur_pte = ept_pt + pte_off;
-		ept_set_pte_rwe(cur_pte);
-		cur_pte->memory_type = EPT_MEMORY_TYPE_WB;
-		cur_pte->ignore_pat = 1;
-		cur_pte->paddr = host >> PAGE_SHIFT;
+	u64 *table;
+	if (!pg_present(*(u64 *)entry)) {
+		table = ept_alloc_table();
+		if (table == NULL)
+			return NULL;
+		/* Only the root is referenced outside of the EPT itself */
+		set_page_movable(table, 1);
+		ept_init_default(entry, virt_to_phys(table));
+	} else {
+		table = ept_next_table(*(u64 *)entry);
 	}
+	return table + index;
 }
 
-static u64 needed_paging_structs(const u64 mem_size, const u64 mapped_size)
+/*
+ * EPT leaf levels: a PTE maps 4K, a PDE 2M and a PDPTE 1G.
+ * Returns the entry mapping `gpa` at `level`, allocating the paging
+ * structures above it.
+ */
+#define EPT_LEVEL_4K	1
+#define EPT_LEVEL_2M	2
+#define EPT_LEVEL_1G	3
+
+#define ept_level_size(level)	(1ull << (PAGE_SHIFT + 9 * ((level) - 1)))
+
+static u64 *ept_alloc_entry(struct ept_pml4e *ept_pml4, gpa_t gpa, u8 level)
 {
-	u64 n = mem_size / mapped_size;
-	if (n == 0)
-		return 1;
-	if (mem_size % mapped_size != 0)
-		n += 1;
-	return n;
+	struct ept_pml4e *pml4e = ept_pml4 + pgd_offset(gpa);
+	u64 *entry = ept_walk_alloc(pml4e, pud_offset(gpa));
+	if (entry == NULL || level == EPT_LEVEL_1G)
+		return entry;
+	entry = ept_walk_alloc(entry, pmd_offset(gpa));
+	if (entry == NULL || level == EPT_LEVEL_2M)
+		return entry;
+	return ept_walk_alloc(entry, pte_offset(gpa));
 }
 
 /*
- * Build EPT structures. Only RWE mappings atm.
+ * Release a paging structure mapping from `gpa`, the tables and the guest
+ * RAM pages below it. Memslot backings belong to whoever added the slot.
+ */
+static void ept_release_table(struct vmm *vmm, u64 *table, u8 level,
+			      gpa_t gpa)
+{
+	for (u16 i = 0; i < EPT_PTRS_PER_TABLE; ++i) {
+		if (!pg_present(table[i]))
+			continue;
+
+		const gpa_t entry_gpa = gpa + i * ept_level_size(level);
+		void *page = (void *)phys_to_virt(table[i] & EPT_PADDR_MASK);
+		const struct memslot *slot = memslot_find(&vmm->memslots,
+							  entry_gpa);
+		const int leaf = level == EPT_LEVEL_4K || pg_huge_page(table[i]);
+		if (!leaf && level == EPT_LEVEL_2M && slot != NULL
+		    && !slot->backing
+		    && slot->huge_hva[memslot_block(slot, entry_gpa)]) {
+			/* 2M page mapped with 4K pages (dirty logging) */
+			release_huge_page(
+				(void *)slot->huge_hva[memslot_block(slot,
+								     entry_gpa)]);
+			set_page_movable(page, 0);
+			release_page(page);
+			continue;
+		}
+		if (!leaf) {
+			ept_release_table(vmm, page, level - 1, entry_gpa);
+			continue;
+		}
+
+		if (slot != NULL && slot->backing)
+			continue;
+		if (level == EPT_LEVEL_1G) {
+			release_pages(page, PUD_SIZE / PAGE_SIZE);
+		} else if (level == EPT_LEVEL_2M) {
+			release_huge_page(page);
+		} else {
+			set_page_movable(page, 0);
+			release_page(page);
+		}
+	}
+	set_page_movable(table, 0);
+	release_page(table);
+}
+
+/* Migrate the movable pages referenced by `table`, returns how many moved */
+static u64 ept_compact_table(u64 *table, u8 level)
+{
+	u64 moved = 0;
+	for (u16 i = 0; i < EPT_PTRS_PER_TABLE; ++i) {
+		if (!pg_present(table[i]))
+			continue;
+		if (level > 1 && pg_huge_page(table[i]))
+			continue;
+
+		void *page = ept_next_table(table[i]);
+		if (level > 1)
+			moved += ept_compact_table(page, level - 1);
+		if (!page_should_migrate(page))
+			continue;
+
+		page = migrate_page(page);
+		if (page == NULL)
+			continue;
+		table[i] = (table[i] & ~EPT_PADDR_MASK) | virt_to_phys(page);
+		++moved;
+	}
+	return moved;
+}
+
+static inline struct ept_pml4e *ept_root(struct vmm *vmm)
+{
+	return (void *)phys_to_virt(vmm->eptp.pml4_addr << PAGE_SHIFT);
+}
+
+static void ept_compact(struct movable_owner *owner)
+{
+	struct vmm *vmm = container_of(owner, struct vmm, ept_owner);
+	if (ept_compact_table((u64 *)ept_root(vmm), 4))
+		__invept(INVEPT_SINGLE_CONTEXT, vmm->eptp.quad_word);
+}
+
+#define EPT_CAP_2M_PAGES	(1ull << 16)
+#define EPT_CAP_1G_PAGES	(1ull << 17)
+#define EPT_CAP_AD_FLAGS	(1ull << 21)
+
+/*
+ * Largest page that can map `size` bytes at `hpa` to `gpa`. Dirty logging
+ * tracks 4K pages.
+ * Build with EPT_4K=1 to map everything with 4K pages, for comparison.
+ */
+static u8 ept_leaf_level(struct vmm *vmm, hpa_t hpa, gpa_t gpa, u64 size,
+			 u32 flags)
+{
+#ifdef EPT_4K_ONLY
+	return EPT_LEVEL_4K;
+#endif
+	if (flags & MEMSLOT_DIRTY_LOG)
+		return EPT_LEVEL_4K;
+
+	const u64 cap = vmm->vmx_msr[VMM_MSR_VMX_EPT_VPID_CAP];
+	const u64 align = hpa | gpa;
+
+	if ((cap & EPT_CAP_1G_PAGES) && size >= PUD_SIZE
+	    && !(align & (PUD_SIZE - 1)))
+		return EPT_LEVEL_1G;
+	if ((cap & EPT_CAP_2M_PAGES) && size >= PMD_SIZE
+	    && !(align & (PMD_SIZE - 1)))
+		return EPT_LEVEL_2M;
+	return EPT_LEVEL_4K;
+}
+
+static void ept_set_leaf(u64 *entry, hpa_t hpa, u8 level, u32 flags)
+{
+	struct ept_pte *pte = (struct ept_pte *)entry;
+	ept_set_pte_rwe(pte);
+	if (flags & MEMSLOT_READONLY)
+		pte->write = 0;
+	pte->memory_type = EPT_MEMORY_TYPE_WB;
+	pte->ignore_pat = 1;
+
+	if (level == EPT_LEVEL_1G) {
+		struct ept_huge_pdpte *pdpte = (struct ept_huge_pdpte *)entry;
+		pdpte->huge_page = 1;
+		pdpte->paddr = hpa >> PUD_SHIFT;
+	} else if (level == EPT_LEVEL_2M) {
+		struct ept_huge_pde *pde = (struct ept_huge_pde *)entry;
+		pde->huge_page = 1;
+		pde->paddr = hpa >> PMD_SHIFT;
+	} else {
+		pte->paddr = hpa >> PAGE_SHIFT;
+	}
+}
+
+/*
+ * Map [gpa, gpa + size) to [hpa, hpa + size), write back, RWE or RE
+ * according to the memslot flags.
  * XXX: atm, KVM only support nested EPT translations using 4 level structures
  * (not more not less), so we'll stick to that. 512G max supported here.
  */
-static int ept_setup_range(struct vmm *vmm, paddr_t host_start,
-			    paddr_t host_end, paddr_t guest_start)
+static int ept_map_range(struct vmm *vmm, hpa_t hpa, gpa_t gpa, u64 size,
+			 u32 flags)
 {
-	const u64 mmap_size = host_end - host_start;
-	if (mmap_size > GB(512))
-		return 1;
+	struct ept_pml4e *ept_pml4 = ept_root(vmm);
 
-	struct ept_pml4e *ept_pml4 = alloc_page();
-	if (ept_pml4 == NULL)
+	for (u64 off = 0; off < size;) {
+		const u8 level = ept_leaf_level(vmm, hpa + off, gpa + off,
+						size - off, flags);
+		u64 *entry = ept_alloc_entry(ept_pml4, gpa + off, level);
+		if (entry == NULL)
+			return 1;
+
+		ept_set_leaf(entry, hpa + off, level, flags);
+		off += ept_level_size(level);
+	}
+	return 0;
+}
+
+/* Returns the entry at `level` for `gpa`, NULL if a table above is missing */
+static u64 *ept_walk(struct ept_pml4e *ept_pml4, gpa_t gpa, u8 level)
+{
+	const u16 offsets[] = {
+		pte_offset(gpa), pmd_offset(gpa), pud_offset(gpa),
+	};
+	u64 *entry = &ept_pml4[pgd_offset(gpa)].quad_word;
+
+	for (u8 l = EPT_LEVEL_1G; l >= level; --l) {
+		if (!pg_present(*entry) || pg_huge_page(*entry))
+			return NULL;
+		entry = (u64 *)ept_next_table(*entry) + offsets[l - 1];
+	}
+	return entry;
+}
+
+/*
+ * Back the guest RAM page containing `gpa` with zeroed memory. A whole 2M
+ * page is used if the memslot covers it, unless part of that 2M range is
+ * already backed by 4K pages. New pages count as dirty. Nothing is done if
+ * `gpa` is already backed, by a 2M leaf in particular.
+ * 4K pages are movable, ept_compact() migrates them.
+ */
+int ept_populate(struct vmm *vmm, gpa_t gpa)
+{
+	struct memslot *slot = memslot_find(&vmm->memslots, gpa);
+	if (slot == NULL || slot->backing)
 		return 1;
-	struct ept_pdpte *ept_pdpt = alloc_page();
-	if (ept_pdpt == NULL)
-		goto free_pml4;
-
-
-	/* Init pml4 with pdpt physical address */
-	struct ept_pml4e *pml4e = ept_pml4 + pgd_offset(guest_start);
-	ept_init_default(pml4e, virt_to_phys(ept_pdpt));
-
-	/* Make ept_pdpt point to the first entry we fill */
-	const u64 pdpt_off = pud_offset(guest_start);
-	ept_pdpt += pdpt_off;
-
-	const u64 needed_pd = needed_paging_structs(mmap_size, GB(1));
-	u64 needed_pt = needed_paging_structs(mmap_size, MB(2));
-	if (pdpt_off + needed_pd >= EPT_PTRS_PER_TABLE)
-		goto free_pdpt;
-
-	struct ept_pde *ept_pd = alloc_pages(needed_pd);
-	if (ept_pd == NULL)
-		goto free_pdpt;
-	struct ept_pte *ept_pt = alloc_pages(needed_pt);
-	if (ept_pt == NULL)
-		goto free_pd;
-
-	memset(ept_pd, 0, needed_pd * PAGE_SIZE);
-	memset(ept_pt, 0, needed_pt * PAGE_SIZE);
-
-	/* Init PDPT */
-	for (u64 i = 0; i < needed_pd; ++i) {
-		struct ept_pde *cur_pd = (vaddr_t)ept_pd + i * PAGE_SIZE;
-		ept_init_default(ept_pdpt + i, virt_to_phys(cur_pd));
-
-		/* Init page directory */
-		for (u64 j = 0; j < EPT_PTRS_PER_TABLE && j < needed_pt; ++j) {
-			struct ept_pde *pde = cur_pd + pmd_offset(guest_start);
-			struct ept_pte *pt = (vaddr_t)ept_pt + j * PAGE_SIZE;
-			ept_init_default(pde, virt_to_phys(pt));
-
-			/* Init page table for current page dir entry */
-			ept_init_pt(pt, host_start, guest_start);
-
-			host_start += MB(2);
-			guest_start += MB(2);
+	if (ept_translate(vmm, gpa) != (hpa_t)-1)
+		return 0;
+
+	const gpa_t huge_gpa = gpa & PMD_MASK;
+	if (memslot_contains(slot, huge_gpa)
+	    && memslot_contains(slot, huge_gpa + PMD_SIZE - 1)) {
+		const u64 *pde = ept_walk(ept_root(vmm), gpa, EPT_LEVEL_2M);
+		void *p = NULL;
+		if (pde == NULL || !pg_present(*pde))
+			p = alloc_zeroed_huge_page();
+		if (p != NULL) {
+			/* Only the first table allocation can fail */
+			if (!ept_map_range(vmm, virt_to_phys(p), huge_gpa,
+					   PMD_SIZE, slot->flags)) {
+				slot->huge_hva[memslot_block(slot, gpa)] =
+					(hva_t)p;
+				if (slot->flags & MEMSLOT_DIRTY_LOG)
+					memslot_mark_dirty(slot, huge_gpa,
+							   PMD_SIZE);
+				return 0;
+			}
+			release_huge_page(p);
+			return 1;
 		}
+	}
 
-		needed_pt -= EPT_PTRS_PER_TABLE;
+	void *p = alloc_zeroed_page();
+	if (p == NULL)
+		return 1;
+	if (!ept_map_range(vmm, virt_to_phys(p), gpa & PAGE_MASK, PAGE_SIZE,
+			  slot->flags)) {
+		if (slot->flags & MEMSLOT_DIRTY_LOG)
+			memslot_mark_dirty(slot, gpa & PAGE_MASK, PAGE_SIZE);
+		set_page_movable(p, 1);
+		return 0;
 	}
+	release_page(p);
+	return 1;
+}
 
-	setup_eptp(&vmm->eptp, ept_pml4);
+/* Write without read access: any guest access is an EPT misconfiguration */
+#define EPT_MMIO_ENTRY	EPT_WRITE
+
+int vmx_add_mmio_region(struct vmm *vmm, gpa_t base, u64 size,
+			const struct mmio_ops *ops, void *opaque)
+{
+	if ((base | size) & ~PAGE_MASK)
+		return 1;
+
+	struct memslot *slot;
+	for_each_memslot(&vmm->memslots, slot) {
+		if (base < slot->base + slot->size && slot->base < base + size)
+			return 1;
+	}
+
+	if (mmio_region_add(&vmm->mmio, base, size, ops, opaque))
+		return 1;
+
+	/* Pages left unmapped on failure exit as EPT violations */
+	for (gpa_t gpa = base; gpa < base + size; gpa += PAGE_SIZE) {
+		u64 *entry = ept_alloc_entry(ept_root(vmm), gpa, EPT_LEVEL_4K);
+		if (entry == NULL)
+			return 1;
+		*entry = EPT_MMIO_ENTRY;
+	}
 	return 0;
+}
 
-free_pd:
-	release_pages(ept_pd, needed_pd);
-free_pdpt:
-	release_page(ept_pdpt);
-free_pml4:
-	release_page(ept_pml4);
+/*
+ * Dirty logging. With EPT A/D flags, the CPU sets the dirty flag of the
+ * 4K leaves. With PML on top, it also logs their GPA in a buffer: only
+ * the logged pages have their dirty flag cleared at harvest. Without PML,
+ * harvesting scans the dirty flags of the whole slot. Without A/D flags,
+ * the leaves are write protected and the first write to each page exits.
+ * Host writes through the guest memory helpers are logged as well.
+ * These run in VMX root with the VMCS loaded, between two guest runs.
+ */
+static inline int ept_has_ad_flags(struct vmm *vmm)
+{
+	return vmm->vmx_msr[VMM_MSR_VMX_EPT_VPID_CAP] & EPT_CAP_AD_FLAGS;
+}
+
+#define PML_ENTRIES	512
+
+static inline int vmx_has_pml(struct vmm *vmm)
+{
+	const u64 ctls2 = vmm->vmx_msr[VMM_IDX(MSR_VMX_PROC_CTLS2)];
+	return (ctls2 >> 32) & VM_EXEC_ENABLE_PML;
+}
+
+static int vmx_enable_pml(struct vmm *vmm)
+{
+	vmm->pml_log = alloc_vcpu_page();
+	if (vmm->pml_log == NULL)
+		return 1;
+
+	__vmwrite(PML_ADDRESS, virt_to_phys(vmm->pml_log));
+	__vmwrite(GUEST_PML_INDEX, PML_ENTRIES - 1);
+
+	u64 ctls2;
+	__vmread(SECONDARY_VM_EXEC_CONTROL, &ctls2);
+	__vmwrite(SECONDARY_VM_EXEC_CONTROL, ctls2 | VM_EXEC_ENABLE_PML);
+	return 0;
+}
+
+/* The index goes down from 511 and wraps once the log is full */
+void vmx_flush_pml(struct vmm *vmm)
+{
+	u64 index;
+	__vmread(GUEST_PML_INDEX, &index);
+	index = (u16)index;
+
+	for (u64 i = index >= PML_ENTRIES ? 0 : index + 1; i < PML_ENTRIES;
+	     ++i) {
+		const gpa_t gpa = vmm->pml_log[i] & PAGE_MASK;
+		struct memslot *slot = memslot_find(&vmm->memslots, gpa);
+		if (slot != NULL && (slot->flags & MEMSLOT_DIRTY_LOG))
+			memslot_mark_dirty(slot, gpa, PAGE_SIZE);
+	}
+	__vmwrite(GUEST_PML_INDEX, PML_ENTRIES - 1);
+}
+
+typedef u64 (*ept_pte_fn_t)(struct memslot *slot, u64 *pte, gpa_t gpa);
+
+/* Call `fn` on the present 4K leaves of `slot`, returns the sum of results */
+static u64 ept_for_each_slot_pte(struct vmm *vmm, struct memslot *slot,
+				 ept_pte_fn_t fn)
+{
+	u64 ret = 0;
+	for (gpa_t gpa = slot->base; memslot_contains(slot, gpa);) {
+		const u64 *pde = ept_walk(ept_root(vmm), gpa, EPT_LEVEL_2M);
+		const gpa_t next = (gpa & PMD_MASK) + PMD_SIZE;
+		if (pde == NULL || !pg_present(*pde) || pg_huge_page(*pde)) {
+			gpa = next;
+			continue;
+		}
+
+		u64 *pt = ept_next_table(*pde);
+		for (; gpa < next && memslot_contains(slot, gpa);
+		     gpa += PAGE_SIZE) {
+			u64 *pte = pt + pte_offset(gpa);
+			if (pg_present(*pte))
+				ret += fn(slot, pte, gpa);
+		}
+	}
+	return ret;
+}
+
+static u64 ept_pte_write_protect(struct memslot *slot __unused, u64 *pte,
+				 gpa_t gpa __unused)
+{
+	return __atomic_fetch_and(pte, ~EPT_WRITE, __ATOMIC_RELAXED)
+	       & EPT_WRITE ? 1 : 0;
+}
+
+static u64 ept_pte_clear_dirty(struct memslot *slot __unused, u64 *pte,
+			       gpa_t gpa __unused)
+{
+	return __atomic_fetch_and(pte, ~EPT_DIRTY, __ATOMIC_RELAXED)
+	       & EPT_DIRTY ? 1 : 0;
+}
+
+static u64 ept_pte_harvest_dirty(struct memslot *slot, u64 *pte, gpa_t gpa)
+{
+	if (!(__atomic_fetch_and(pte, ~EPT_DIRTY, __ATOMIC_RELAXED)
+	      & EPT_DIRTY))
+		return 0;
+	memslot_mark_dirty(slot, gpa, PAGE_SIZE);
 	return 1;
 }
 
-/* XXX: ATM allocates 200M of memory for the VM */
-static int setup_ept(struct vmm *vmm)
+/* Map the 2M pages of `slot` with 4K pages */
+static int ept_split_slot(struct vmm *vmm, struct memslot *slot)
 {
-	u8 nb_pages = 100;
-	void *p = alloc_huge_pages(nb_pages);
-	if (p == NULL)
+	const gpa_t end = slot->base + slot->size;
+	for (gpa_t gpa = slot->base & PMD_MASK; gpa < end; gpa += PMD_SIZE) {
+		u64 *pde = ept_walk(ept_root(vmm), gpa, EPT_LEVEL_2M);
+		if (pde == NULL || !pg_huge_page(*pde))
+			continue;
+
+		u64 *pt = ept_alloc_table();
+		if (pt == NULL)
+			return 1;
+
+		const hpa_t hpa = *pde & EPT_PADDR_MASK & PMD_MASK;
+		for (u16 i = 0; i < EPT_PTRS_PER_TABLE; ++i)
+			ept_set_leaf(pt + i, hpa + i * PAGE_SIZE, EPT_LEVEL_4K,
+				     slot->flags);
+
+		set_page_movable(pt, 1);
+		*pde = 0;
+		ept_init_default(pde, virt_to_phys(pt));
+	}
+	return 0;
+}
+
+int ept_enable_dirty_log(struct vmm *vmm, struct memslot *slot)
+{
+	if (slot->backing || (slot->flags & MEMSLOT_DIRTY_LOG))
 		return 1;
 
-	paddr_t start = virt_to_phys(p);
-	paddr_t end = start + nb_pages * HUGE_PAGE_SIZE;
-	if (ept_setup_range(vmm, start, end, 0))
+	const u64 sz = memslot_dirty_bitmap_size(slot);
+	slot->dirty_bitmap = kmalloc(sz);
+	if (slot->dirty_bitmap == NULL)
+		return 1;
+	memset(slot->dirty_bitmap, 0, sz);
+
+	slot->flags |= MEMSLOT_DIRTY_LOG;
+	if (ept_split_slot(vmm, slot)) {
+		/* Leaves already split stay so */
+		slot->flags &= ~MEMSLOT_DIRTY_LOG;
+		kfree(slot->dirty_bitmap);
+		slot->dirty_bitmap = NULL;
 		return 1;
-	vmm->guest_mem.start = p;
-	vmm->guest_mem.end = phys_to_virt(end);
+	}
+
+	if (ept_has_ad_flags(vmm)) {
+		if (!vmm->eptp.enable_dirty_flag) {
+			vmm->eptp.enable_dirty_flag = 1;
+			__vmwrite(EPT_POINTER, vmm->eptp.quad_word);
+		}
+		/* Start from clean pages */
+		ept_for_each_slot_pte(vmm, slot, ept_pte_harvest_dirty);
+		memset(slot->dirty_bitmap, 0, sz);
+
+		/* Scanning the dirty flags at harvest remains the fallback */
+		if (vmm->pml_log == NULL && vmx_has_pml(vmm))
+			vmx_enable_pml(vmm);
+	} else {
+		ept_for_each_slot_pte(vmm, slot, ept_pte_write_protect);
+	}
+
+	__invept(INVEPT_SINGLE_CONTEXT, vmm->eptp.quad_word);
 	return 0;
 }
 
-/* GPA -> HPA */
+int ept_get_dirty_log(struct vmm *vmm, struct memslot *slot, u64 *bitmap)
+{
+	if (!(slot->flags & MEMSLOT_DIRTY_LOG))
+		return 1;
+
+	/* Pages to rearm, one by one: the scan already did it otherwise */
+	ept_pte_fn_t rearm = ept_pte_write_protect;
+	u64 flush = 0;
+	if (vmm->pml_log != NULL) {
+		vmx_flush_pml(vmm);
+		rearm = ept_pte_clear_dirty;
+	} else if (vmm->eptp.enable_dirty_flag) {
+		flush += ept_for_each_slot_pte(vmm, slot,
+					       ept_pte_harvest_dirty);
+		rearm = NULL;
+	}
+
+	const u64 nb_words = memslot_dirty_bitmap_size(slot) / sizeof(u64);
+	for (u64 i = 0; i < nb_words; ++i) {
+		bitmap[i] = __atomic_exchange_n(&slot->dirty_bitmap[i], 0,
+						__ATOMIC_RELAXED);
+		for (u64 bits = bitmap[i]; rearm && bits; bits &= bits - 1) {
+			const u64 page = i * 64 + __builtin_ctzll(bits);
+			const gpa_t gpa = slot->base + page * PAGE_SIZE;
+			u64 *pte = ept_walk(ept_root(vmm), gpa, EPT_LEVEL_4K);
+			if (pte != NULL && pg_present(*pte))
+				flush += rearm(slot, pte, gpa);
+		}
+	}
+
+	if (flush)
+		__invept(INVEPT_SINGLE_CONTEXT, vmm->eptp.quad_word);
+	return 0;
+}
+
+int ept_log_dirty_write(struct vmm *vmm, gpa_t gpa)
+{
+	struct memslot *slot = memslot_find(&vmm->memslots, gpa);
+	if (slot == NULL || !(slot->flags & MEMSLOT_DIRTY_LOG)
+	    || (slot->flags & MEMSLOT_READONLY) || vmm->eptp.enable_dirty_flag)
+		return 1;
+
+	u64 *pte = ept_walk(ept_root(vmm), gpa, EPT_LEVEL_4K);
+	if (pte == NULL || !pg_present(*pte))
+		return 1;
+
+	memslot_mark_dirty(slot, gpa & PAGE_MASK, PAGE_SIZE);
+	__atomic_or_fetch(pte, EPT_WRITE, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* XXX: ATM the VM has 200M of RAM */
+#define GUEST_RAM_SIZE	MB(200)
+
+/*
+ * Only the memslots with a host backing are mapped upfront, guest RAM is
+ * backed on first access.
+ */
+static int setup_ept(struct vmm *vmm)
+{
+	struct ept_pml4e *ept_pml4 = ept_alloc_table();
+	if (ept_pml4 == NULL)
+		return 1;
+	setup_eptp(&vmm->eptp, ept_pml4);
+
+	if (!vmm->memslots.nr_slots
+	    && memslots_add_ram(&vmm->memslots, GUEST_RAM_SIZE))
+		goto free_ept;
+
+	const struct memslot *slot;
+	for_each_memslot(&vmm->memslots, slot) {
+		if (slot->backing
+		    && ept_map_range(vmm, virt_to_phys(slot->backing),
+				     slot->base, slot->size, slot->flags))
+			goto free_ept;
+	}
+	return 0;
+
+free_ept:
+	ept_release_table(vmm, (u64 *)ept_pml4, 4, 0);
+	memslots_clear(&vmm->memslots);
+	return 1;
+}
+
+/* GPA -> HPA, (hpa_t)-1 if not mapped (yet) */
 hpa_t ept_translate(struct vmm *vmm, gpa_t addr)
 {
+	if (memslot_find(&vmm->memslots, addr) == NULL)
+		return (paddr_t)-1;
+
 	struct eptp *eptp = &vmm->eptp;
 
 	paddr_t pgd_addr = eptp->pml4_addr << PAGE_SHIFT;
@@ -222,12 +813,20 @@ hpa_t ept_translate(struct vmm *vmm, gpa_t addr)
 	u16 pud_off = pud_offset(addr);
 	if (!pg_present(pud[pud_off].quad_word))
 		return (paddr_t)-1;
+	if (pg_huge_page(pud[pud_off].quad_word)) {
+		struct ept_huge_pdpte *huge = (void *)&pud[pud_off];
+		return ((hpa_t)huge->paddr << PUD_SHIFT) + (addr & ~PUD_MASK);
+	}
 
 	paddr_t pmd_addr = (paddr_t)(pud[pud_off].quad_word & PAGE_MASK);
 	struct ept_pde *pmd = (void *)phys_to_virt(pmd_addr);
 	u16 pmd_off = pmd_offset(addr);
 	if (!pg_present(pmd[pmd_off].quad_word))
 		return (paddr_t)-1;
+	if (pg_huge_page(pmd[pmd_off].quad_word)) {
+		struct ept_huge_pde *huge = (void *)&pmd[pmd_off];
+		return ((hpa_t)huge->paddr << PMD_SHIFT) + (addr & ~PMD_MASK);
+	}
 
 	paddr_t pt_addr = (paddr_t)(pmd[pmd_off].quad_word & PAGE_MASK);
 	struct ept_pte *pte = (void *)phys_to_virt(pt_addr);
@@ -239,50 +838,114 @@ hpa_t ept_translate(struct vmm *vmm, gpa_t addr)
 	return (hpa_t)((pte[pte_off].quad_word & PAGE_MASK) + page_off);
 }
 
-hva_t gpa_to_hva(struct vmm *vmm, gpa_t gpa)
+/*
+ * Only RAM not backed by a 2M page needs an EPT walk. `len` gets the number
+ * of bytes from `gpa` that are contiguous in the host. A 4K page may move
+ * on the next compaction pass, do not keep its HVA across allocations.
+ */
+hva_t gpa_to_hva_len(struct vmm *vmm, gpa_t gpa, u64 *len)
 {
+	const struct memslot *slot = memslot_find(&vmm->memslots, gpa);
+	if (slot == NULL)
+		return 0;
+	if (slot->backing) {
+		*len = slot->base + slot->size - gpa;
+		return slot->backing + gpa - slot->base;
+	}
+
+	const hva_t huge_hva = slot->huge_hva[memslot_block(slot, gpa)];
+	if (huge_hva) {
+		*len = PMD_SIZE - (gpa & ~PMD_MASK);
+		return huge_hva + (gpa & ~PMD_MASK);
+	}
+
 	hpa_t hpa = ept_translate(vmm, gpa);
+	if (hpa == (hpa_t)-1)
+		return 0;
+	*len = PAGE_SIZE - (gpa & ~PAGE_MASK);
 	return (hva_t)phys_to_virt(hpa);
 }
 
-/* XXX: Only works with 64 bit paging backed with EPT */
-/* Guest virtual to guest physical */
-gpa_t gva_to_gpa(struct vmm *vmm, gva_t gva)
+hva_t gpa_to_hva(struct vmm *vmm, gpa_t gpa)
 {
-	u64 guest_cr3 = vmm->guest_state.reg_state.control_regs.cr3 & PAGE_MASK;
+	u64 len;
+	return gpa_to_hva_len(vmm, gpa, &len);
+}
 
-	hva_t *guest_pgd = (hva_t *)gpa_to_hva(vmm, guest_cr3);
-	gpa_t pml4e = guest_pgd[pgd_offset(gva)];
-	if (!pg_present(pml4e))
-		return (gpa_t)-1;
+#define GUEST_PG_PERMS	(PG_WRITABLE|PG_USER)
 
-	hva_t *guest_pud = (hva_t *)gpa_to_hva(vmm, pml4e & PAGE_MASK);
-	gpa_t pdpte = guest_pud[pud_offset(gva)];
-	if (!pg_present(pdpte))
-		return (gpa_t)-1;
-	if (pg_huge_page(pdpte))
-		return (pdpte & PAGE_MASK) + (gva & ~PUD_MASK);
+/*
+ * XXX: Only works with 64 bit paging backed with EPT
+ * Walk the guest page tables, `perms` gets the permissions of the
+ * translation: writable and user only if allowed at every level, no
+ * execute if denied at any.
+ */
+static gpa_t guest_walk(struct vmm *vmm, u64 cr3, gva_t gva, u64 *perms)
+{
+	const u16 offsets[] = {
+		pte_offset(gva), pmd_offset(gva), pud_offset(gva),
+		pgd_offset(gva),
+	};
+	gpa_t table = cr3 & PG_PADDR_MASK;
+	u64 p = GUEST_PG_PERMS;
+
+	for (u8 level = 4; level >= 1; --level) {
+		const u64 *entries = (u64 *)gpa_to_hva(vmm, table);
+		if (entries == NULL)
+			return (gpa_t)-1;
+
+		const u64 e = entries[offsets[level - 1]];
+		if (!pg_present(e))
+			return (gpa_t)-1;
+		p &= e | ~GUEST_PG_PERMS;
+		p |= e & PG_NO_EXECUTE;
+
+		if (level == 1 || (level < 4 && pg_huge_page(e))) {
+			const u64 size = 1ULL << (PAGE_SHIFT + 9 * (level - 1));
+			*perms = p;
+			return (e & PG_PADDR_MASK & ~(size - 1))
+			       + (gva & (size - 1));
+		}
+		table = e & PG_PADDR_MASK;
+	}
+	return (gpa_t)-1;
+}
 
-	hva_t *guest_pmd = (hva_t *)gpa_to_hva(vmm, pdpte & PAGE_MASK);
-	gpa_t pde = guest_pmd[pmd_offset(gva)];
-	if (!pg_present(pde))
-		return (gpa_t)-1;
-	if (pg_huge_page(pde))
-		return (pde & PAGE_MASK) + (gva & ~PMD_MASK);
+gpa_t gva_translate(struct vmm *vmm, gva_t gva, u64 *perms)
+{
+	const u64 cr3 = vmcs_cache_read(vmm, VCACHE_CR3);
+	u64 p;
+
+	/* Once guest CR3 writes and INVLPG stop exiting, always walk */
+	const int use_tlb = vmm->cr3_load_exits;
+
+	gpa_t gpa = (gpa_t)-1;
+	if (use_tlb)
+		gpa = guest_tlb_lookup(&vmm->tlb, cr3, gva, &p);
+	if (gpa == (gpa_t)-1) {
+		gpa = guest_walk(vmm, cr3, gva, &p);
+		if (gpa == (gpa_t)-1)
+			return gpa;
+		if (use_tlb)
+			guest_tlb_insert(&vmm->tlb, cr3, gva, gpa, p);
+	}
 
-	hva_t *guest_pt = (hva_t *)gpa_to_hva(vmm, pde & PAGE_MASK);
-	gpa_t pte = guest_pt[pte_offset(gva)];
-	if (!pg_present(pte))
-		return (gpa_t)-1;
+	if (perms != NULL)
+		*perms = p;
+	return gpa;
+}
 
-	return (pte & PAGE_MASK) + (gva & ~PAGE_MASK);
+/* Guest virtual to guest physical */
+gpa_t gva_to_gpa(struct vmm *vmm, gva_t gva)
+{
+	return gva_translate(vmm, gva, NULL);
 }
 
 hva_t gva_to_hva(struct vmm *vmm, gva_t gva)
 {
 	gpa_t gpa = gva_to_gpa(vmm, gva);
 	if (gpa == (gpa_t)-1)
-		return (hva_t)-1;
+		return 0;
 
 	return gpa_to_hva(vmm, gpa);
 }
@@ -321,7 +984,9 @@ static void vmcs_fill_msr_state(struct vmcs_state_msr *msr)
 #endif
 }
 
-#define VM_EXIT_STACK_SIZE	(PAGE_SIZE - 32)
+/* The exit stack grows down from the register save area */
+#define VM_EXIT_STACK_SIZE \
+	(PAGE_SIZE - __align_n(sizeof(struct vm_exit_ctx), 16))
 extern void vm_exit_stub(void);
 static int vmcs_get_host_state(struct vmcs_host_state *state)
 {
@@ -338,7 +1003,7 @@ static int vmcs_get_host_state(struct vmcs_host_state *state)
 
 	vmcs_fill_msr_state(&state->msr);
 
-	void *ptr = kmalloc(PAGE_SIZE);
+	void *ptr = kmem_cache_alloc(vm_exit_stack_cache);
 	if (ptr == NULL)
 		return 1;
 	state->rsp = (u64)ptr + VM_EXIT_STACK_SIZE;
@@ -348,16 +1013,9 @@ static int vmcs_get_host_state(struct vmcs_host_state *state)
 
 static inline void host_set_stack_ctx(struct vmm *vmm)
 {
-	*((void **)vmm->host_state.rsp) = (void *)vmm;
+	((struct vm_exit_ctx *)vmm->host_state.rsp)->vmm = vmm;
 }
 
-#define VMM_IDX(idx) 		((idx) - MSR_VMX_BASIC)
-#define VMM_MSR_VMX_BASIC	VMM_IDX(MSR_VMX_BASIC)
-#define VMM_MSR_VMX_CR0_FIXED0	VMM_IDX(MSR_VMX_CR0_FIXED0)
-#define VMM_MSR_VMX_CR0_FIXED1	VMM_IDX(MSR_VMX_CR0_FIXED1)
-#define VMM_MSR_VMX_CR4_FIXED0	VMM_IDX(MSR_VMX_CR4_FIXED0)
-#define VMM_MSR_VMX_CR4_FIXED1	VMM_IDX(MSR_VMX_CR4_FIXED1)
-
 static inline void vmcs_write_control(struct vmm *vmm, enum vmcs_field field,
 				      u64 ctl, u64 ctl_msr)
 {
@@ -384,33 +1042,120 @@ static inline void vmcs_write_proc_based_ctrls2(struct vmm *vmm, u64 ctl)
 			   MSR_VMX_PROC_CTLS2);
 }
 
-#define EXCEPTION_UD	(1ull << 6)
-#define EXCEPTION_PF	(1ull << 14)
-#define EXCEPTION_BITMAP_MASK	~(EXCEPTION_PF|EXCEPTION_UD)
+/*
+ * The hypervisor owns the guest CR0 and CR4 bits fixed by VMX operation
+ * (PE and PG are free for an unrestricted guest) and CR4.VMXE: guest
+ * writes to the other bits do not exit. CR0.PG is kept to catch the switch
+ * to long mode. The read shadows hold the values the guest wrote.
+ */
+#define CR0_UNRESTRICTED	(CR0_PE|CR0_PG)
+
+u64 vmx_guest_cr0(struct vmm *vmm, u64 cr0)
+{
+	cr0 |= vmm->vmx_msr[VMM_MSR_VMX_CR0_FIXED0] & ~CR0_UNRESTRICTED;
+	return cr0 & vmm->vmx_msr[VMM_MSR_VMX_CR0_FIXED1];
+}
+
+u64 vmx_guest_cr4(struct vmm *vmm, u64 cr4)
+{
+	cr4 |= CR4_VMXE | vmm->vmx_msr[VMM_MSR_VMX_CR4_FIXED0];
+	return cr4 & vmm->vmx_msr[VMM_MSR_VMX_CR4_FIXED1];
+}
+
+static void vmcs_write_cr_masks(struct vmm *vmm)
+{
+	const u64 cr0_mask =
+		(vmm->vmx_msr[VMM_MSR_VMX_CR0_FIXED0] & ~CR0_UNRESTRICTED)
+		| ~vmm->vmx_msr[VMM_MSR_VMX_CR0_FIXED1] | CR0_PG;
+	const u64 cr4_mask = CR4_VMXE | vmm->vmx_msr[VMM_MSR_VMX_CR4_FIXED0]
+			     | ~vmm->vmx_msr[VMM_MSR_VMX_CR4_FIXED1];
+
+	const struct control_regs *regs =
+		&vmm->guest_state.reg_state.control_regs;
+	__vmwrite(CR0_READ_SHADOW, regs->cr0);
+	__vmwrite(CR0_GUEST_HOST_MASK, cr0_mask);
+	__vmwrite(CR4_READ_SHADOW, regs->cr4 & ~CR4_VMXE);
+	__vmwrite(CR4_GUEST_HOST_MASK, cr4_mask);
+}
+
+/*
+ * Guest exceptions are delivered through the guest IDT without exiting,
+ * only the ones intercepted with vmx_intercept_exception() exit.
+ */
+#define EXCEPTION_BITMAP_DEFAULT	0
 static void vmcs_write_vm_exec_controls(struct vmm *vmm)
 {
-	vmcs_write_pin_based_ctrls(vmm, 0);
+	/* Host NMIs exit, and are reflected to the guest when it can take them */
+	vmcs_write_pin_based_ctrls(vmm, VM_PIN_NMI_EXIT|VM_PIN_VIRTUAL_NMIS);
+	u64 pin;
+	__vmread(PIN_BASED_VM_EXEC_CONTROL, &pin);
+	vmm->virtual_nmis = !!(pin & VM_PIN_VIRTUAL_NMIS);
 
 	u64 proc_flags1 = VM_EXEC_USE_MSR_BITMAPS|VM_EXEC_ENABLE_PROC_CTLS2|
-			  VM_EXEC_CR3_LOAD_EXIT|VM_EXEC_UNCONDITIONAL_IO_EXIT;
+			  VM_EXEC_CR3_LOAD_EXIT|VM_EXEC_UNCONDITIONAL_IO_EXIT|
+			  VM_EXEC_INVLPG_EXIT|VM_EXEC_HLT_EXIT;
 	u64 proc_flags2 = VM_EXEC_UNRESTRICTED_GUEST|VM_EXEC_ENABLE_EPT;
+	if (vmm->vpid) {
+		proc_flags2 |= VM_EXEC_ENABLE_VPID;
+		__vmwrite(VIRTUAL_PROCESSOR_ID, vmm->vpid);
+	}
 	vmcs_write_proc_based_ctrls(vmm, proc_flags1);
 	vmcs_write_proc_based_ctrls2(vmm, proc_flags2);
+	vmm->hlt_activity = !!(vmm->vmx_msr[VMM_MSR_VMX_MISC]
+			       & VMX_MISC_ACTIVITY_HLT);
 
-	__vmwrite(EXCEPTION_BITMAP, EXCEPTION_BITMAP_MASK);
+	__vmwrite(EXCEPTION_BITMAP, EXCEPTION_BITMAP_DEFAULT);
 	__vmwrite(MSR_BITMAP, virt_to_phys((vaddr_t)vmm->msr_bitmap));
 
-	u64 guest_cr0 = vmm->guest_state.reg_state.control_regs.cr0;
-	__vmwrite(CR0_READ_SHADOW, guest_cr0);
-	__vmwrite(CR0_GUEST_HOST_MASK, guest_cr0);
-
-	u64 guest_cr4 = vmm->guest_state.reg_state.control_regs.cr4;
-	__vmwrite(CR4_READ_SHADOW, guest_cr4);
-	__vmwrite(CR4_GUEST_HOST_MASK, guest_cr4);
+	u64 ctl;
+	__vmread(CPU_BASED_VM_EXEC_CONTROL, &ctl);
+	vmm->cr3_load_exits = !!(ctl & VM_EXEC_CR3_LOAD_EXIT);
 
+	vmcs_write_cr_masks(vmm);
 	__vmwrite(EPT_POINTER, vmm->eptp.quad_word);
 }
 
+/*
+ * Guest CR3 loads need no work in long mode with EPT: no PDPTEs to load.
+ * Without them, the software TLB cannot be kept coherent and is no longer
+ * used, so INVLPG needs no work either: the guest's own covers its VPID
+ * tagged entries.
+ */
+void vmx_drop_cr3_load_exits(struct vmm *vmm)
+{
+	u64 ctl;
+	__vmread(CPU_BASED_VM_EXEC_CONTROL, &ctl);
+	vmcs_write_proc_based_ctrls(vmm, ctl & ~VM_EXEC_CR3_LOAD_EXIT);
+
+	__vmread(CPU_BASED_VM_EXEC_CONTROL, &ctl);
+	vmm->cr3_load_exits = !!(ctl & VM_EXEC_CR3_LOAD_EXIT);
+	if (!vmm->cr3_load_exits) {
+		vmcs_write_proc_based_ctrls(vmm, ctl & ~VM_EXEC_INVLPG_EXIT);
+		guest_tlb_flush(&vmm->tlb);
+	}
+}
+
+static void vmx_window_exits(struct vmm *vmm, u64 window, int enable)
+{
+	u64 ctl;
+	__vmread(CPU_BASED_VM_EXEC_CONTROL, &ctl);
+	if (enable)
+		ctl |= window;
+	else
+		ctl &= ~window;
+	vmcs_write_proc_based_ctrls(vmm, ctl);
+}
+
+void vmx_interrupt_window_exits(struct vmm *vmm, int enable)
+{
+	vmx_window_exits(vmm, VM_EXEC_INTR_WINDOW_EXIT, enable);
+}
+
+void vmx_nmi_window_exits(struct vmm *vmm, int enable)
+{
+	vmx_window_exits(vmm, VM_EXEC_NMI_WINDOW_EXIT, enable);
+}
+
 static void vmcs_write_vm_exit_controls(struct vmm *vmm)
 {
 	vmcs_write_control(vmm, VM_EXIT_CONTROLS,
@@ -559,9 +1304,7 @@ static inline void vmcs_write_vm_guest_state(struct vmm *vmm)
 
 static int init_msr_bitmap(struct vmm *vmm)
 {
-	vmm->msr_bitmap = alloc_page();
-	if (vmm->msr_bitmap != NULL)
-		memset(vmm->msr_bitmap, 0, MSR_ALL_BITMAP_SZ);
+	vmm->msr_bitmap = alloc_vcpu_page();
 	return vmm->msr_bitmap == NULL;
 }
 
@@ -586,6 +1329,8 @@ fail:
 int vmm_init(struct vmm *vmm)
 {
 	vmm_read_vmx_msrs(vmm);
+	if (vmx_init_caches())
+		return 1;
 	if (alloc_vmcs(vmm))
 		return 1;
 
@@ -617,11 +1362,17 @@ int vmm_init(struct vmm *vmm)
 	}
 
 	if (init_msr_bitmap(vmm))
-		goto free_host;
+		goto free_ept;
 
-	vmm->setup_guest(vmm);
+	if (vmm->setup_guest(vmm)) {
+		printf("Failed to load the guest\n");
+		goto free_msr;
+	}
 	init_vm_exit_handlers(vmm);
 
+	/* Nothing else to do before the guest starts */
+	fill_zeroed_pages();
+
 	if (__vmxon(virt_to_phys(vmm->vmx_on))) {
 		printf("VMXON failed\n");
 		goto free_msr;
@@ -638,6 +1389,7 @@ int vmm_init(struct vmm *vmm)
 		goto free_vmxoff;
 	}
 
+	vmm->vpid = alloc_vpid(vmm);
 	vmcs_write_vm_exec_controls(vmm);
 	vmcs_write_vm_exit_controls(vmm);
 	vmcs_write_vm_entry_controls(vmm);
@@ -649,22 +1401,32 @@ int vmm_init(struct vmm *vmm)
 
 	vmcs_write_vm_guest_state(vmm);
 
+	/* The EPT can only be invalidated once VMX is on */
+	vmm->ept_owner.compact = ept_compact;
+	register_movable_owner(&vmm->ept_owner);
+
 	printf("Hello from VMX ROOT\n");
 	printf("Entering guest ...\n");
 
 	if (launch_vm(vmm)) {
 		printf("VMLAUNCH failed\n");
+		unregister_movable_owner(&vmm->ept_owner);
 		goto free_vmxoff;
 	}
 
 	return 0;
 
 free_vmxoff:
+	release_vpid(vmm->vpid);
 	__vmxoff();
 free_msr:
-	release_page(vmm->msr_bitmap);
+	release_vcpu_page(vmm->msr_bitmap);
+free_ept:
+	ept_release_table(vmm, (u64 *)ept_root(vmm), 4, 0);
+	memslots_clear(&vmm->memslots);
 free_host:
-	kfree((void *)(vmm->host_state.rsp - VM_EXIT_STACK_SIZE));
+	kmem_cache_free(vm_exit_stack_cache,
+			(void *)(vmm->host_state.rsp - VM_EXIT_STACK_SIZE));
 free_vmcs:
 	release_vmcs(vmm);
 	return 1;
@@ -3,6 +3,8 @@
 #include <page.h>
 #include <vmx.h>
 #include <io.h>
+#include <guest_mem.h>
+#include <hypercall.h>
 
 #include <linux/bootparam.h>
 #include <linux/e820.h>
@@ -110,7 +112,7 @@ void setup_test_guest(struct vmm *vmm)
 	reg_state->dr7 = read_dr7();
 	reg_state->regs.rflags = read_rflags() | 0x2;
 	reg_state->regs.rsp = read_rsp();
-	reg_state->regs.rip = vmm->guest_mem.start + (1 << 20);
+	reg_state->regs.rip = (1 << 20);
 	(void)test_code;
 
 	vmm->guest_state.vmcs_link = (u64)-1ULL;
@@ -273,8 +275,82 @@ int setup_test_guest32(struct vmm *vmm)
 	vmm->guest_state.vmcs_link = VMX_NO_VMCS_LINK;
 
 	/* +4 is hack to skip 64 bit prologue */
-	memcpy(vmm->guest_mem.start + (1 << 20), test_code32 + 4,
-	       (u64)dummy_func - (u64)test_code32);
+	if (copy_to_guest_phys(vmm, 1 << 20, test_code32 + 4,
+			       (u64)dummy_func - (u64)test_code32))
+		return 1;
+
+	vmm->guest_state.reg_state.regs.rsp = 0x400000;
+	vmm->guest_state.reg_state.regs.rip = (1 << 20);
+
+	return 0;
+}
+
+/*
+ * EPT TLB reach benchmark: the guest reads one dword per 4K page of 64M of
+ * RAM, with paging off so that only EPT translates its accesses, and
+ * reports the mean cost of a read with the HC_STRIDE_BENCH hypercall.
+ * The reads are spread over the cache sets by moving 64 bytes further in
+ * every page. Compare a build with EPT_4K=1 to one with huge leaves.
+ */
+#define STRIDE_BENCH_BASE	0x1000000
+#define STRIDE_BENCH_END	0x5000000
+#define STRIDE_BENCH_PASSES	16
+#define STRIDE_BENCH_READS						\
+	(((STRIDE_BENCH_END - STRIDE_BENCH_BASE) >> 12) * STRIDE_BENCH_PASSES)
+
+extern const char stride_bench_code32[], stride_bench_code32_end[];
+
+asm (".pushsection .text\n\t"
+     ".code32\n"
+     "stride_bench_code32:\n\t"
+     /* Back every page first, the timed passes take no EPT violation */
+     "mov	$" __stringify(STRIDE_BENCH_BASE) ", %esi\n"
+     "1:\n\t"
+     "mov	(%esi), %eax\n\t"
+     "add	$0x1000, %esi\n\t"
+     "cmp	$" __stringify(STRIDE_BENCH_END) ", %esi\n\t"
+     "jb	1b\n\t"
+     "lfence\n\t"
+     "rdtsc\n\t"
+     "mov	%eax, %edi\n\t"
+     "mov	%edx, %ebp\n\t"
+     "mov	$" __stringify(STRIDE_BENCH_PASSES) ", %ecx\n"
+     "2:\n\t"
+     "mov	$" __stringify(STRIDE_BENCH_BASE) ", %esi\n\t"
+     "xor	%ebx, %ebx\n"
+     "3:\n\t"
+     "mov	(%esi, %ebx), %eax\n\t"
+     "add	$64, %ebx\n\t"
+     "and	$0xfff, %ebx\n\t"
+     "add	$0x1000, %esi\n\t"
+     "cmp	$" __stringify(STRIDE_BENCH_END) ", %esi\n\t"
+     "jb	3b\n\t"
+     "dec	%ecx\n\t"
+     "jnz	2b\n\t"
+     "lfence\n\t"
+     "rdtsc\n\t"
+     "sub	%edi, %eax\n\t"
+     "sbb	%ebp, %edx\n\t"
+     "mov	$" __stringify(STRIDE_BENCH_READS) ", %ecx\n\t"
+     "div	%ecx\n\t"
+     "mov	%eax, %ebx\n\t"
+     "mov	$" __stringify(HC_STRIDE_BENCH) ", %eax\n\t"
+     "vmcall\n"
+     "4:\n\t"
+     "hlt\n\t"
+     "jmp	4b\n"
+     "stride_bench_code32_end:\n\t"
+     ".code64\n\t"
+     ".popsection");
+
+int setup_stride_bench_guest(struct vmm *vmm)
+{
+	setup_x86_default_regs(vmm);
+	vmm->guest_state.vmcs_link = VMX_NO_VMCS_LINK;
+
+	if (copy_to_guest_phys(vmm, 1 << 20, stride_bench_code32,
+			       stride_bench_code32_end - stride_bench_code32))
+		return 1;
 
 	vmm->guest_state.reg_state.regs.rsp = 0x400000;
 	vmm->guest_state.reg_state.regs.rip = (1 << 20);
@@ -298,20 +374,27 @@ static inline void set_e820_entry(struct boot_e820_entry *entry, u64 addr,
 	entry->type = type;
 }
 
-static void init_e820_table(struct boot_params *params)
+/* One entry per memslot, ROM and reserved slots are not RAM */
+static void init_e820_table(struct vmm *vmm, struct boot_params *params)
 {
 	u8 idx = 0;
-	struct boot_e820_entry *pre_isa = &params->e820_table[idx++];
-	struct boot_e820_entry *post_isa = &params->e820_table[idx++];
+	const struct memslot *slot;
+
+	for_each_memslot(&vmm->memslots, slot) {
+		if (idx == E820_MAX_ENTRIES_ZEROPAGE)
+			break;
 
-	set_e820_entry(pre_isa, 0x0, ISA_START_ADDRESS - 1, E820_RAM);
-	set_e820_entry(post_isa, ISA_END_ADDRESS, (200 << 20) - ISA_END_ADDRESS,
-		       E820_RAM);
+		const u32 reserved = MEMSLOT_READONLY|MEMSLOT_RESERVED;
+		u32 type = slot->flags & reserved ? E820_RESERVED : E820_RAM;
+		set_e820_entry(&params->e820_table[idx++], slot->base,
+			       slot->size, type);
+	}
 
 	params->e820_entries = idx;
 }
 
-static void init_linux_boot_params(struct boot_params *params)
+static void init_linux_boot_params(struct vmm *vmm,
+				   struct boot_params *params)
 {
 	if (params->hdr.setup_sects == 0)
 		params->hdr.setup_sects = 4;
@@ -326,7 +409,7 @@ static void init_linux_boot_params(struct boot_params *params)
 
 	params->hdr.cmd_line_ptr = COMMAND_LINE_ADDR;
 
-	init_e820_table(params);
+	init_e820_table(vmm, params);
 }
 
 static char *read_kernel_version(struct vmm *vmm, struct setup_header *hdr)
@@ -340,19 +423,18 @@ static char *read_kernel_version(struct vmm *vmm, struct setup_header *hdr)
 	return kversion;
 }
 
-static void setup_linux_cmdline(struct vmm *vmm, const char *cmdline)
+static int setup_linux_cmdline(struct vmm *vmm, const char *cmdline)
 {
 	u64 cmdline_len = strlen(cmdline);
-	void *cmdline_ptr = (void *)(vmm->guest_mem.start + COMMAND_LINE_ADDR);
 	/* Include null byte */
-	memcpy(cmdline_ptr, cmdline, cmdline_len + 1);
+	return copy_to_guest_phys(vmm, COMMAND_LINE_ADDR, cmdline,
+				  cmdline_len + 1);
 }
 
 int setup_linux_guest(struct vmm *vmm)
 {
 	setup_x86_default_regs(vmm);
 
-	vaddr_t ram_start = vmm->guest_mem.start;
 	vaddr_t img_start = vmm->guest_img.start;
 	vaddr_t img_end   = vmm->guest_img.end;
 	u64 img_sz = img_end - img_start;
@@ -361,7 +443,11 @@ int setup_linux_guest(struct vmm *vmm)
 
 	printf("Linux Version: %s\n", read_kernel_version(vmm, hdr));
 
-	struct boot_params *boot_params = (void *)(ram_start + BOOT_SECTOR_ADDR);
+	/* The zero page fits in a single guest page */
+	if (ept_populate(vmm, BOOT_SECTOR_ADDR))
+		return 1;
+	struct boot_params *boot_params =
+		(void *)gpa_to_hva(vmm, BOOT_SECTOR_ADDR);
 	memset(boot_params, 0, sizeof(struct boot_params));
 
 	/* from Documentation/x86/boot.txt:
@@ -370,23 +456,26 @@ int setup_linux_guest(struct vmm *vmm)
 	 */
 	u64 setup_hdr_end = 0x202 + ((u8 *)img_start)[0x201];
 	memcpy(&boot_params->hdr, hdr, setup_hdr_end - SETUP_HDR_OFFSET);
-	init_linux_boot_params(boot_params);
+	init_linux_boot_params(vmm, boot_params);
 
 	/* TODO remove hardcoded cmdline */
 	const char *cmdline = "console=ttyS0 earlyprintk=serial nokaslr";
-	setup_linux_cmdline(vmm, cmdline);
+	if (setup_linux_cmdline(vmm, cmdline))
+		return 1;
 
 	u64 kernel_offset = (boot_params->hdr.setup_sects + 1) * SECTOR_SIZE;
 	u64 kernel_sz = img_sz - kernel_offset;
 	void *kernel = (void *)(img_start + kernel_offset);
-	memcpy((void *)(ram_start + LINUX_KERNEL_LOAD_ADDR), kernel, kernel_sz);
+	if (copy_to_guest_phys(vmm, LINUX_KERNEL_LOAD_ADDR, kernel, kernel_sz))
+		return 1;
 
 	if (!vaddr_null_range(vmm->guest_initrd)) {
 		u64 initrd_addr = LINUX_KERNEL_LOAD_ADDR + kernel_sz;
 		u64 initrd_sz = vmm->guest_initrd.end - vmm->guest_initrd.start;
 
-		memcpy((void *)(ram_start + initrd_addr),
-		       (void *)vmm->guest_initrd.start, initrd_sz);
+		if (copy_to_guest_phys(vmm, initrd_addr,
+				       (void *)vmm->guest_initrd.start, initrd_sz))
+			return 1;
 
 		boot_params->hdr.ramdisk_image = initrd_addr;
 		boot_params->hdr.ramdisk_size = initrd_sz;
@@ -77,7 +77,7 @@ static void screen_putc(struct screen *screen, const char c)
 #define CONS_BLACK 0
 #define CONS_WHITE 7
 static struct screen vga_text = {
-	.fb = (char *)0xb8000 + PHYS_MAP_START,
+	.fb = (char *)0xb8000 + PAGE_OFFSET,
 	.x = 0,
 	.y = 0,
 	.w = 80,
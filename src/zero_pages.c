@@ -0,0 +1,165 @@
+#include <compact.h>
+#include <compiler.h>
+#include <memory.h>
+#include <page.h>
+#include <spinlock.h>
+
+/*
+ * Pools of pre-zeroed 4K and 2M pages. They are refilled in small steps
+ * when the guest halts (and entirely before the guest starts), using
+ * non-temporal stores so that zeroing does not evict the cache.
+ * A 2M page is zeroed 4K at a time over several steps.
+ * 4K pages are movable while they sit in the pool.
+ */
+#define ZERO_POOL_PAGES		64
+#define ZERO_POOL_HUGE_PAGES	4
+
+struct zero_pool {
+	void *pages[ZERO_POOL_PAGES];
+	u32 nr_pages;
+	void *huge_pages[ZERO_POOL_HUGE_PAGES];
+	u32 nr_huge_pages;
+	u8 *huge_partial;	/* Huge page being zeroed */
+	u64 huge_done;		/* Bytes of huge_partial already zeroed */
+};
+
+static struct zero_pool zero_pool;
+static spinlock_t zero_pool_lock = SPINLOCK_INIT;
+
+/* `n` must be a multiple of 64 */
+static void zero_nt(void *p, u64 n)
+{
+	u64 *q = p;
+	for (u64 i = 0; i < n / sizeof(u64); i += 8) {
+		asm volatile ("movnti %1, 0(%0)\n\t"
+			      "movnti %1, 8(%0)\n\t"
+			      "movnti %1, 16(%0)\n\t"
+			      "movnti %1, 24(%0)\n\t"
+			      "movnti %1, 32(%0)\n\t"
+			      "movnti %1, 40(%0)\n\t"
+			      "movnti %1, 48(%0)\n\t"
+			      "movnti %1, 56(%0)"
+			      : /* No output */
+			      : "r"(q + i), "r"(0ULL)
+			      : "memory");
+	}
+	asm volatile ("sfence" ::: "memory");
+}
+
+/* Zero at most `budget` bytes of pages for the pools, returns the work done */
+static u64 zero_pool_step(u64 budget)
+{
+	struct zero_pool *pool = &zero_pool;
+	u64 done = 0;
+
+	while (done < budget && pool->nr_pages < ZERO_POOL_PAGES) {
+		void *p = alloc_page();
+		if (p == NULL)
+			return done;
+		zero_nt(p, PAGE_SIZE);
+		set_page_movable(p, 1);
+		pool->pages[pool->nr_pages++] = p;
+		done += PAGE_SIZE;
+	}
+
+	while (done < budget && pool->nr_huge_pages < ZERO_POOL_HUGE_PAGES) {
+		if (pool->huge_partial == NULL) {
+			pool->huge_partial = alloc_huge_page();
+			if (pool->huge_partial == NULL)
+				return done;
+			pool->huge_done = 0;
+		}
+
+		zero_nt(pool->huge_partial + pool->huge_done, PAGE_SIZE);
+		pool->huge_done += PAGE_SIZE;
+		done += PAGE_SIZE;
+
+		if (pool->huge_done == HUGE_PAGE_SIZE) {
+			pool->huge_pages[pool->nr_huge_pages++] = pool->huge_partial;
+			pool->huge_partial = NULL;
+		}
+	}
+	return done;
+}
+
+/* The pool may be refilling and be the reason of this compaction */
+static void zero_pool_compact(struct movable_owner *owner __unused)
+{
+	if (!spin_trylock(&zero_pool_lock))
+		return;
+
+	for (u32 i = 0; i < zero_pool.nr_pages; ++i) {
+		void *p = zero_pool.pages[i];
+		if (!page_should_migrate(p))
+			continue;
+		p = migrate_page(p);
+		if (p != NULL)
+			zero_pool.pages[i] = p;
+	}
+	spin_unlock(&zero_pool_lock);
+}
+
+static struct movable_owner zero_pool_owner = {
+	.compact = zero_pool_compact,
+};
+
+void refill_zeroed_pages(u64 budget)
+{
+	spin_lock(&zero_pool_lock);
+	zero_pool_step(budget);
+	spin_unlock(&zero_pool_lock);
+}
+
+void fill_zeroed_pages(void)
+{
+	static int registered;
+	if (!registered) {
+		/* The boot is over, the pools may use all of memory */
+		finish_frame_init();
+		register_movable_owner(&zero_pool_owner);
+		registered = 1;
+	}
+
+	spin_lock(&zero_pool_lock);
+	while (zero_pool_step(HUGE_PAGE_SIZE))
+		continue;
+	spin_unlock(&zero_pool_lock);
+}
+
+void *alloc_zeroed_pages(u64 n)
+{
+	void *p = NULL;
+	if (n == 1) {
+		spin_lock(&zero_pool_lock);
+		if (zero_pool.nr_pages)
+			p = zero_pool.pages[--zero_pool.nr_pages];
+		spin_unlock(&zero_pool_lock);
+		if (p != NULL) {
+			set_page_movable(p, 0);
+			return p;
+		}
+	}
+
+	p = alloc_pages(n);
+	if (p != NULL)
+		zero_nt(p, n * PAGE_SIZE);
+	return p;
+}
+
+void *alloc_zeroed_huge_pages(u64 n)
+{
+	void *p = NULL;
+	if (n == 1) {
+		spin_lock(&zero_pool_lock);
+		if (zero_pool.nr_huge_pages)
+			p = zero_pool.huge_pages[--zero_pool.nr_huge_pages];
+		spin_unlock(&zero_pool_lock);
+		if (p != NULL)
+			return p;
+	}
+
+	p = alloc_huge_pages(n);
+	if (p != NULL)
+		zero_nt(p, n * HUGE_PAGE_SIZE);
+	return p;
+}
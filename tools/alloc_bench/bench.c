@@ -0,0 +1,368 @@
+/*
+ * Hosted benchmark of the frame allocator: replays a trace of frame
+ * allocations and frees against the original free list allocator and
+ * against the frame allocator of src/page_alloc.c (the buddy allocator,
+ * or the bitmap backend when built with FRAME_BITMAP=1), on a fake memory
+ * map of 64 GiB by default.
+ *
+ * usage: alloc_bench [-m GiB] [-f frames] [-n ops] [-s seed] [trace]
+ *
+ * A trace has one operation per line, "a <id> <frames>" allocates frames
+ * and "f <id>" frees them. Without a trace file, a random one is made:
+ * `-f` single frames (all of memory by default) are allocated and about
+ * half of them freed to fragment memory, then `-n` operations on mostly
+ * single frames, some small runs and 2M blocks follow.
+ */
+#include <compact.h>
+#include <mem_stats.h>
+#include <page.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+u8 *bench_phys_base;
+
+/* The frame metadata goes right after the kernel image and modules */
+#define BENCH_METADATA_PADDR	(16ULL << 20)
+#define LOW_HOLE_START		(3ULL << 30)
+#define LOW_HOLE_END		(4ULL << 30)
+
+/* Kernel services the allocator core links against, unused here */
+int compact_pages_released;
+
+u64 compact_memory(void)
+{
+	return 0;
+}
+
+void alloc_site_account(struct alloc_sites *sites __unused,
+			const void *site __unused, int free __unused)
+{
+}
+
+void alloc_sites_dump(const struct alloc_sites *sites __unused)
+{
+}
+
+void bench_fail(const char *msg)
+{
+	fprintf(stderr, "alloc_bench: %s\n", msg);
+	exit(1);
+}
+
+struct trace_op {
+	u32 free;
+	u32 id;
+	u64 nb_frames;
+};
+
+struct trace {
+	struct trace_op *ops;
+	u64 nr_ops;
+	u32 nr_ids;
+};
+
+static struct mem_zone bench_zones[3];
+
+/* RAM below 640K, then up to the PCI hole and the rest above 4G */
+static void setup_memory_map(u64 gib)
+{
+	const u64 size = gib << 30;
+
+	bench_zones[0] = (struct mem_zone){ PAGE_SIZE, 0x9f000 - PAGE_SIZE,
+					    MEM_RAM_USABLE | MEM_LOW_MEM };
+	bench_zones[1] = (struct mem_zone){ 1ULL << 20,
+					    LOW_HOLE_START - (1ULL << 20),
+					    MEM_RAM_USABLE };
+	bench_zones[2] = (struct mem_zone){ LOW_HOLE_END,
+					    size - LOW_HOLE_START,
+					    MEM_RAM_USABLE };
+	memory_map.zones = bench_zones;
+	memory_map.zone_cnt = 3;
+
+	/* Only the allocator metadata is ever written to */
+	bench_phys_base = mmap(NULL, last_valid_paddr(), PROT_READ|PROT_WRITE,
+			       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (bench_phys_base == MAP_FAILED)
+		bench_fail("Cannot reserve the fake physical memory");
+}
+
+/* Frames both allocators hand out */
+static u64 usable_frames(paddr_t reserved_end)
+{
+	u64 n = 0;
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i)
+		n += memory_map.zones[i].length / PAGE_SIZE;
+	return n - (reserved_end - BENCH_KERNEL_PADDR + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static u64 rand_state;
+
+static u64 xorshift(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+static u64 random_size(void)
+{
+	const u64 r = xorshift() % 100;
+	if (r < 85)
+		return 1;
+	if (r < 95)
+		return 2ULL << (xorshift() % 6);	/* 8K to 256K */
+	return 512;				/* 2M */
+}
+
+static struct trace_op *trace_alloc(struct trace *trace, u64 nb_frames)
+{
+	struct trace_op *op = &trace->ops[trace->nr_ops++];
+	op->id = trace->nr_ids++;
+	op->nb_frames = nb_frames;
+	return op;
+}
+
+static void trace_free(struct trace *trace, u32 *live, u64 *nr_live)
+{
+	const u64 victim = xorshift() % *nr_live;
+	struct trace_op *op = &trace->ops[trace->nr_ops++];
+	op->free = 1;
+	op->id = live[victim];
+	live[victim] = live[--*nr_live];
+}
+
+/* Fill allocations are freed by groups of a 2M block worth of frames */
+#define FILL_GROUP	512
+
+/*
+ * `nr_fill` single frames are allocated and freed again, all of a group
+ * of consecutive allocations one time out of 8, a random half of the group
+ * otherwise, to leave memory fragmented. Then come `nr_ops` operations
+ * keeping about `nr_ops / 2` more allocations live.
+ */
+static void generate_trace(struct trace *trace, u64 nr_fill, u64 nr_ops)
+{
+	trace->ops = calloc(2 * nr_fill + nr_ops, sizeof(*trace->ops));
+	u32 *live = calloc(max(nr_ops, FILL_GROUP), sizeof(*live));
+	if (live == NULL || trace->ops == NULL)
+		bench_fail("Cannot allocate the trace");
+
+	trace->nr_ops = 0;
+	trace->nr_ids = 0;
+	for (u64 i = 0; i < nr_fill; ++i)
+		trace_alloc(trace, 1);
+
+	/* The remaining fill frames are never freed */
+	u64 nr_live;
+	for (u64 first = 0; first < nr_fill; first += FILL_GROUP) {
+		nr_live = 0;
+		for (u64 id = first; id < min(first + FILL_GROUP, nr_fill); ++id)
+			live[nr_live++] = id;
+
+		const u64 nr_free = xorshift() % 8 ? nr_live / 2 : nr_live;
+		for (u64 i = 0; i < nr_free; ++i)
+			trace_free(trace, live, &nr_live);
+	}
+
+	nr_live = 0;
+	for (u64 i = 0; i < nr_ops; ++i) {
+		if (nr_live == 0 || (nr_live < nr_ops / 2 && xorshift() % 100 < 60))
+			live[nr_live++] = trace_alloc(trace, random_size())->id;
+		else
+			trace_free(trace, live, &nr_live);
+	}
+	free(live);
+}
+
+static void load_trace(struct trace *trace, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		bench_fail("Cannot open the trace");
+
+	u64 cap = 4096;
+	trace->ops = malloc(cap * sizeof(*trace->ops));
+	trace->nr_ops = 0;
+	trace->nr_ids = 0;
+
+	char line[128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct trace_op op = { 0 };
+		char kind;
+		unsigned long long n = 0;
+
+		if (sscanf(line, "%c %u %llu", &kind, &op.id, &n) < 2
+		    || (kind != 'a' && kind != 'f'))
+			continue;
+		op.free = kind == 'f';
+		op.nb_frames = n;
+		if (!op.free && n == 0)
+			bench_fail("Allocation of 0 frames in the trace");
+
+		if (trace->nr_ops == cap) {
+			cap *= 2;
+			trace->ops = realloc(trace->ops, cap * sizeof(*trace->ops));
+		}
+		if (trace->ops == NULL)
+			bench_fail("Cannot allocate the trace");
+		trace->ops[trace->nr_ops++] = op;
+		trace->nr_ids = max(trace->nr_ids, op.id + 1);
+	}
+	fclose(f);
+}
+
+struct frame_allocator {
+	const char *name;
+	void *(*alloc)(u64 nb_frames);
+	void (*release)(void *p, u64 n);
+};
+
+static void *kernel_alloc_frames(u64 nb_frames)
+{
+	return alloc_page_frames(nb_frames);
+}
+
+static void kernel_release_frames(void *p, u64 n)
+{
+	release_page_frames(p, n);
+}
+
+enum { OP_ALLOC, OP_ALLOC_HUGE, OP_FREE, NR_OP_KINDS };
+
+static const char *op_kind_str[NR_OP_KINDS] = {
+	"alloc <2M", "alloc >=2M", "free"
+};
+
+struct op_stats {
+	u64 count;
+	u64 ns;
+	u64 max_ns;
+};
+
+static inline u64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct live_alloc {
+	void *p;
+	u64 nb_frames;
+};
+
+static void replay(const struct frame_allocator *a, const struct trace *trace)
+{
+	struct live_alloc *allocs = calloc(trace->nr_ids, sizeof(*allocs));
+	struct op_stats stats[NR_OP_KINDS] = { 0 };
+	u64 failed = 0;
+	if (allocs == NULL)
+		bench_fail("Cannot allocate the replay state");
+
+	const u64 start = now_ns();
+	for (u64 i = 0; i < trace->nr_ops; ++i) {
+		const struct trace_op *op = &trace->ops[i];
+		struct live_alloc *la = &allocs[op->id];
+		u32 kind;
+		u64 t;
+
+		if (op->free) {
+			if (la->p == NULL)
+				continue;
+			kind = OP_FREE;
+			t = now_ns();
+			a->release(la->p, la->nb_frames);
+			t = now_ns() - t;
+			la->p = NULL;
+		} else {
+			kind = op->nb_frames >= 512 ? OP_ALLOC_HUGE : OP_ALLOC;
+			t = now_ns();
+			la->p = a->alloc(op->nb_frames);
+			t = now_ns() - t;
+			la->nb_frames = op->nb_frames;
+			failed += la->p == NULL;
+		}
+		stats[kind].count++;
+		stats[kind].ns += t;
+		stats[kind].max_ns = max(stats[kind].max_ns, t);
+	}
+
+	printf("%s: %.3f s, %llu failed allocations\n", a->name,
+	       (now_ns() - start) / 1e9, failed);
+	for (u32 k = 0; k < NR_OP_KINDS; ++k) {
+		if (stats[k].count)
+			printf("  %-10s %10llu ops, mean %8llu ns, max %10llu ns\n",
+			       op_kind_str[k], stats[k].count,
+			       stats[k].ns / stats[k].count, stats[k].max_ns);
+	}
+	free(allocs);
+}
+
+int main(int argc, char **argv)
+{
+	u64 gib = 64;
+	u64 nr_fill = (u64)-1;
+	u64 nr_ops = 20000;
+	int opt;
+
+	rand_state = 0x2545f4914f6cdd1dULL;
+	while ((opt = getopt(argc, argv, "m:f:n:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			gib = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			nr_fill = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			rand_state = strtoull(optarg, NULL, 0) | 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m GiB] [-f frames] [-n ops] "
+				"[-s seed] [trace]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (gib <= LOW_HOLE_END >> 30)
+		bench_fail("The memory map needs more than 4 GiB");
+
+	setup_memory_map(gib);
+
+	u64 t = now_ns();
+	setup_frame_state(phys_to_virt(BENCH_METADATA_PADDR));
+	finish_frame_init();
+	printf("New allocator setup: %.3f s\n", (now_ns() - t) / 1e9);
+
+	const paddr_t reserved_end = BENCH_METADATA_PADDR + frame_metadata_size();
+	t = now_ns();
+	old_setup(reserved_end);
+	printf("Old allocator setup: %.3f s\n", (now_ns() - t) / 1e9);
+
+	struct trace trace;
+	if (optind < argc)
+		load_trace(&trace, argv[optind]);
+	else
+		generate_trace(&trace, min(nr_fill, usable_frames(reserved_end)),
+			       nr_ops);
+	printf("%llu GiB memory map, %llu operations\n", gib, trace.nr_ops);
+
+	const struct frame_allocator new_alloc = {
+		"New allocator", kernel_alloc_frames, kernel_release_frames
+	};
+	const struct frame_allocator old_alloc = {
+		"Old allocator", old_alloc_frames, old_release_frames
+	};
+	replay(&new_alloc, &trace);
+	replay(&old_alloc, &trace);
+	return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <types.h>
+#include <page_types.h>
+
+void bench_fail(const char *msg);
+
+/* The original free list allocator, on the same memory map */
+void old_setup(paddr_t reserved_end);
+void *old_alloc_frames(u64 nb_frames);
+void old_release_frames(void *p, u64 n);
+
+#endif /* !_BENCH_H_ */
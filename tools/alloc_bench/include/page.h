@@ -0,0 +1,31 @@
+#ifndef _BENCH_PAGE_H_
+#define _BENCH_PAGE_H_
+
+/*
+ * The kernel page.h, with the direct map replaced by the fake physical
+ * memory of the benchmark: an address space reservation where only the
+ * frame allocator metadata is ever touched.
+ */
+#define virt_to_phys	kernel_virt_to_phys
+#define phys_to_virt	kernel_phys_to_virt
+#include_next <page.h>
+#undef virt_to_phys
+#undef phys_to_virt
+
+extern u8 *bench_phys_base;
+
+static inline paddr_t virt_to_phys(const vaddr_t vaddr)
+{
+	return vaddr - (vaddr_t)bench_phys_base;
+}
+
+static inline vaddr_t phys_to_virt(const paddr_t paddr)
+{
+	return (vaddr_t)bench_phys_base + paddr;
+}
+
+/* Kernel image at 2M, KERNEL_LMA of src/hyper.lds */
+#define BENCH_KERNEL_PADDR	(2ULL << 20)
+#define _start			((char *)phys_to_virt(BENCH_KERNEL_PADDR))
+
+#endif /* !_BENCH_PAGE_H_ */
@@ -0,0 +1,83 @@
+#include <page.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+/*
+ * The original frame allocator, kept for comparison: every free frame is
+ * on a single list, walked from its tail, and runs are probed frame by
+ * frame.
+ */
+struct old_frame {
+	vaddr_t vaddr;
+	struct list free_list;
+};
+
+static DECLARE_LIST(old_free_list);
+static struct old_frame *old_begin, *old_end;
+
+static inline paddr_t old_frame_to_phys(const struct old_frame *f)
+{
+	return (f - old_begin) << PAGE_SHIFT;
+}
+
+static inline int old_paddr_is_usable(paddr_t paddr)
+{
+	for (u32 i = 0; i < memory_map.zone_cnt; ++i) {
+		const struct mem_zone *zone = &memory_map.zones[i];
+		if (paddr >= zone->start && paddr < zone->start + zone->length)
+			return mem_is_usable(zone->type);
+	}
+	return 0;
+}
+
+void old_setup(paddr_t reserved_end)
+{
+	const u64 nb_frames = last_valid_paddr() / PAGE_SIZE;
+
+	old_begin = calloc(nb_frames, sizeof(*old_begin));
+	if (old_begin == NULL)
+		bench_fail("Cannot allocate the old frame array");
+	old_end = old_begin + nb_frames;
+
+	for (struct old_frame *f = old_begin; f < old_end; ++f) {
+		list_init(&f->free_list);
+		const paddr_t paddr = old_frame_to_phys(f);
+		if (!old_paddr_is_usable(paddr))
+			continue;
+		if (paddr < BENCH_KERNEL_PADDR || paddr >= reserved_end)
+			list_add(&old_free_list, &f->free_list);
+	}
+}
+
+#define OLD_FRAME_ENTRY(l)	list_entry((l), struct old_frame, free_list)
+
+void *old_alloc_frames(u64 nb_frames)
+{
+	struct list *l;
+	list_for_each_reverse(&old_free_list, l) {
+		struct old_frame *start = OLD_FRAME_ENTRY(l);
+		struct old_frame *end;
+		u64 n = nb_frames;
+		for (end = start; end < old_end && n > 0; ++end, --n)
+			if (list_empty(&end->free_list))
+				break;
+		/* No contigous frames found */
+		if (n > 0)
+			continue;
+
+		/* Remove frames from free list */
+		for (struct old_frame *f = start; f < end; ++f)
+			list_remove(&f->free_list);
+
+		return start;
+	}
+	return NULL;
+}
+
+void old_release_frames(void *p, u64 n)
+{
+	struct old_frame *f = p;
+	for (u64 i = 0; i < n; ++i)
+		list_add(&old_free_list, &f[i].free_list);
+}